@@ -11,3 +11,30 @@ CGI         ?= 0
 CHROOT      ?= 0
 # Authorization
 AUTH        ?= 0
+# Multiple worker processes (fork, SO_REUSEPORT)
+WORKER      ?= 1
+# I/O threads (pthread)
+THREAD      ?= 0
+# Use accept4() (Linux 2.6.28)
+ACCEPT4     ?= 1
+# Use epoll (select otherwise)
+EPOLL       ?= 1
+# Cork responses with TCP_CORK (MSG_MORE otherwise)
+TCPCORK     ?= 0
+# Keep static files opened between requests
+FILECACHE   ?= 1
+# Resolve files beneath the document root with openat2() (Linux 5.6)
+OPENAT2     ?= 1
+# Open static files in a pool of threads, off the event loop (pthread)
+OPENPOOL    ?= 0
+# accept, recv and send with io_uring (Linux 6.0, polls only with 5.13),
+# epoll is used if it is not available
+IOURING     ?= 0
+# Hint the kernel to read large static files ahead of sendfile (fadvise)
+READAHEAD   ?= 1
+# Serve foo.br or foo.gz instead of foo if the client accepts it
+PRECOMPRESSED ?= 1
+# Compress text files on the fly, in a pool of threads (zlib, pthread)
+COMPRESS    ?= 0
+# Also with zstd (libzstd), needs COMPRESS
+ZSTD        ?= 0
@@ -9,6 +9,9 @@
 #include <aranea/config.h>
 #include <aranea/types.h>
 #include <aranea/server.h>
+#include <aranea/poller.h>
+#include <aranea/uring.h>
+#include <aranea/timer.h>
 #include <aranea/state.h>
 #include <aranea/client.h>
 #include <aranea/clientpool.h>
@@ -16,6 +19,11 @@
 #include <aranea/mimetype.h>
 #include <aranea/cgi.h>
 #include <aranea/auth.h>
+#include <aranea/worker.h>
+#include <aranea/thread.h>
+#include <aranea/filecache.h>
+#include <aranea/opener.h>
+#include <aranea/zcache.h>
 
 #define A_QUOTE(x)              #x
 #define A_TOSTR(x)              A_QUOTE(x)
@@ -24,6 +32,13 @@
 #define A_SIZEOF(x)             (sizeof(x) / sizeof((x)[0]))
 #define A_MAX(x, y)             ((x) > (y) ? (x) : (y))
 
+/** Per-thread storage of the event loop state */
+#if HAVE_THREAD == 1
+# define A_TLS                  __thread
+#else
+# define A_TLS
+#endif
+
 #ifdef DEBUG
 # define A_ERR(fmt, ...)        fprintf(stderr, "*%s\t\t" fmt "\n", A_SRC, __VA_ARGS__)
 # define A_LOG(fmt, ...)        fprintf(stdout, "-%s\t\t" fmt "\n", A_SRC, __VA_ARGS__)
@@ -32,18 +47,19 @@
 # define A_LOG(fmt, ...)
 #endif
 
-/** General purpose buffer, used by CGI
+/** General purpose buffer, used by CGI and to send small files
  */
-#define GBUFF_LENGTH            A_MAX(MAX_CGIENV_LENGTH, \
+#define GBUFF_LENGTH            A_MAX(A_MAX(MAX_CGIENV_LENGTH,      \
+                                    MAX_INLINE_LENGTH),             \
                                     A_MAX(MAX_PATH_LENGTH, MAX_REQUEST_LENGTH))
 
 /* aranea.c */
 
 /* global variables */
-extern time_t g_curtime;
+extern A_TLS time_t g_curtime;
 extern struct config_t g_config;
-extern char g_buff[GBUFF_LENGTH];
-extern struct server_t g_server;
+extern A_TLS char g_buff[GBUFF_LENGTH];
+extern A_TLS struct server_t g_server;
 
 #endif /* ARANEA_H_ */
 
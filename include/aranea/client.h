@@ -8,6 +8,10 @@
 
 #include <aranea/types.h>
 
+/** Room for the response in client->data (pipelined data is at the end).
+ */
+#define CLIENT_DATA_FREE(c)     ((int)(sizeof((c)->data) - (c)->data_pipelined))
+
 /** Allocate memory for a client.
  */
 struct client_t *client_new();
@@ -28,6 +32,10 @@ void client_add(struct client_t *self, struct client_t **list);
  */
 void client_detach(struct client_t *self);
 
+/** Close (or give back to the file cache) the file being sent.
+ */
+void client_close_file(struct client_t *self);
+
 /** Close connection from the client.
  */
 void client_close(struct client_t *self);
@@ -36,6 +44,31 @@ void client_close(struct client_t *self);
  */
 void client_process(struct client_t *self);
 
+/** Move to the next part of a multipart/byteranges response, its boundary
+ * and fields are appended to data.
+ * @return -1 if they do not fit.
+ */
+int client_next_part(struct client_t *self);
+
+/** Open a regular file (path from http_get_realpath) and get its
+ * information. The client is not needed, it can be called from any thread.
+ * @return the descriptor, -1 on error with errno set (EACCES if it is
+ *         not a regular file).
+ */
+int client_open_path(const char *path, struct stat *st);
+
+#if HAVE_PRECOMPRESSED == 1
+/** Look for the compressed siblings of path which are not older than it,
+ * it can be called from any thread.
+ * @return mask of ENCODING_*.
+ */
+unsigned int client_probe_variants(const char *path, time_t mtime);
+#endif
+
+/** Continue the request in STATE_OPENING with the file opened by the pool.
+ */
+void client_opened(struct client_t *self);
+
 #endif /* ARANEA_CLIENT_H_ */
 
 /* vim: set ts=4 sw=4 expandtab: */
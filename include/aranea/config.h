@@ -15,11 +15,54 @@
 #define MAX_PATH_LENGTH             512         /* PATH_MAX */
 #define MAX_CGIENV_LENGTH           1024
 #define MAX_CGIENV_ITEM             10
-#define MAX_CONN                    10
+#define MAX_INLINE_LENGTH           4096        /* body sent with header */
+#define MAX_CONN                    4096        /* default, per process */
+#define MAX_CONN_LIMIT              (1 << 20)   /* upper bound of -c */
+#define LISTEN_BACKLOG              128         /* default */
+#define LISTEN_BACKLOG_LIMIT        65535       /* upper bound of -b */
+#define MAX_ACCEPT_PER_POLL         32
 #define NUM_CACHED_CONN             4
+#define MAX_WORKERS                 64
+#define MAX_THREADS                 64
+#define THREAD_RING_SIZE            256         /* handed off connections */
+#define MAX_POLL_EVENTS             64
+#define SENDFILE_CHUNK              65536       /* bytes per sendfile() */
+#define SENDFILE_QUOTA              262144      /* per connection and loop */
+#define READAHEAD_MIN_LENGTH        (1 << 20)   /* files hinted to the kernel */
+#define READAHEAD_WINDOW            (2 << 20)   /* requested ahead of sendfile */
+#define READAHEAD_DROP_LENGTH       0           /* files above drop the sent
+                                                   pages, 0 never */
+#define TIMER_BITS                  6
+#define TIMER_SLOTS                 (1 << TIMER_BITS)  /* per wheel level */
+#define FILECACHE_SIZE              256         /* opened files, shared */
+#define FILECACHE_BUCKETS           512
+#define FILECACHE_TTL               2           /* sec, before revalidation */
+#define FILECACHE_HEADER_LENGTH     256         /* rendered header fields */
+#define FILECACHE_MAX_CONTENT       16384       /* files kept in memory */
+#define FILECACHE_MEMORY            (1 << 20)   /* per process */
+#define FILECACHE_NOTFOUND          64          /* urls answered with 404 */
+#define FILECACHE_NOTFOUND_TTL      2           /* sec */
+#define OPENPOOL_THREADS            4           /* open() and fstat() */
+#define URING_ENTRIES               256         /* submission queue */
+#define URING_BUFFERS               256         /* for recv, power of 2 */
+#define URING_BUFFER_LENGTH         MAX_REQUEST_LENGTH
+#define URING_BUFFERS_PER_FD        4           /* received in advance */
+#define URING_SEND_LENGTH           32768       /* copied per send */
+#define ZCACHE_SIZE                 256         /* compressed files */
+#define ZCACHE_BUCKETS              512
+#define ZCACHE_MEMORY               (32 << 20)  /* per process */
+#define ZCACHE_MIN_LENGTH           256         /* original file */
+#define ZCACHE_MAX_LENGTH           (8 << 20)
+#define ZCACHE_THREADS              1           /* compressing */
+#define ZCACHE_CHUNK                65536       /* read and written */
+#define ZCACHE_GZIP_LEVEL           6
+#define ZCACHE_ZSTD_LEVEL           3
 
 #define MAX_IP_LENGTH               40
 #define MAX_DATE_LENGTH             32      /* */
+#define MAX_ETAG_LENGTH             64      /* "ino-size-mtime-encoding" */
+#define MAX_RANGES                  8       /* more are ignored (whole file) */
+#define MAX_PART_LENGTH             256     /* boundary and fields of a part */
 #define DATE_FORMAT                 "%a, %d %b %Y %H:%M:%S GMT"
 
 /* Currently, support only plain password */
@@ -55,9 +98,45 @@
 #ifndef HAVE_VFORK
 # define HAVE_VFORK                 0
 #endif
+#ifndef HAVE_WORKER
+# define HAVE_WORKER                0
+#endif
+#ifndef HAVE_THREAD
+# define HAVE_THREAD                0
+#endif
+#ifndef HAVE_EPOLL
+# define HAVE_EPOLL                 0
+#endif
+#ifndef HAVE_ACCEPT4
+# define HAVE_ACCEPT4               0
+#endif
 #ifndef HAVE_TCPCORK
 # define HAVE_TCPCORK               0
 #endif
+#ifndef HAVE_FILECACHE
+# define HAVE_FILECACHE             0
+#endif
+#ifndef HAVE_OPENAT2
+# define HAVE_OPENAT2               0
+#endif
+#ifndef HAVE_OPENPOOL
+# define HAVE_OPENPOOL              0
+#endif
+#ifndef HAVE_IOURING
+# define HAVE_IOURING               0
+#endif
+#ifndef HAVE_PRECOMPRESSED
+# define HAVE_PRECOMPRESSED         0
+#endif
+#ifndef HAVE_COMPRESS
+# define HAVE_COMPRESS              0
+#endif
+#ifndef HAVE_ZSTD
+# define HAVE_ZSTD                  0
+#endif
+#ifndef HAVE_READAHEAD
+# define HAVE_READAHEAD             0
+#endif
 
 #endif /* ARANEA_CONFIG_H_ */
 
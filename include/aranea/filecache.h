@@ -0,0 +1,62 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_FILECACHE_H_
+#define ARANEA_FILECACHE_H_
+
+#include <sys/stat.h>
+
+#include <aranea/types.h>
+
+/** Look up an opened file by its path. The entry is checked against the
+ * file system (stat and compressed siblings) when it is older than
+ * FILECACHE_TTL seconds, by the opener pool if it is running (the entry
+ * is still returned then). The cache is shared by the threads.
+ * @return the entry with a reference taken, NULL if it is not cached.
+ */
+struct filecache_t *filecache_get(const char *path);
+
+/** Cache an opened regular file, the cache owns fd from now on.
+ * A file up to FILECACHE_MAX_CONTENT bytes is read in memory (within
+ * FILECACHE_MEMORY) and closed, entry->fd is -1 then. The fields of a 200
+ * response are rendered now, the entry is not modified afterwards.
+ * If another thread cached the same file meanwhile, its entry is returned
+ * and fd is closed.
+ * @return the entry with a reference taken, NULL if there is no room
+ *         (the caller keeps fd).
+ */
+struct filecache_t *filecache_put(const char *path, int fd,
+        const struct stat *st, const char *type, unsigned int variants);
+
+/** Check the entry against the file system and drop it from the cache if
+ * the file has changed, then release a reference. Called by the opener
+ * pool, see filecache_get.
+ */
+void filecache_revalidate(struct filecache_t *self);
+
+/** Drop a reference. The file stays open for the next clients.
+ */
+void filecache_release(struct filecache_t *self);
+
+/** Check if the (sanitized) url was recently not found.
+ */
+int filecache_notfound(const char *url);
+
+/** Remember that the url does not exist for FILECACHE_NOTFOUND_TTL seconds.
+ */
+void filecache_add_notfound(const char *url);
+
+/** Copy the counters of the cache (since the start of the process).
+ */
+void filecache_stats(struct filecache_stats_t *stats);
+
+/** Close all cached files (entries must have been released by every
+ * thread).
+ */
+void filecache_cleanup();
+
+#endif /* ARANEA_FILECACHE_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -6,37 +6,81 @@
 #ifndef ARANEA_HTTP_H_
 #define ARANEA_HTTP_H_
 
+#include <sys/stat.h>
+
 #include <aranea/types.h>
 
 /** Parse HTTP headers.
  */
 int http_parse(struct request_t *self, char *data, int sz);
 
-/** Get the path from url in the request.
+/** Get the content codings accepted by the client (ENCODING_*) from the
+ * value of Accept-Encoding, which may be NULL.
+ */
+unsigned int http_parse_encoding(const char *val);
+
+/** Render the strong entity tag of a file from its inode, size and
+ * modification time.
+ * @return length, 0 if it does not fit.
+ */
+int http_gen_etag(char *data, int sz, const struct stat *st);
+
+/** Check if the entity tag (etag, len) is in the list of If-None-Match
+ * (weak comparison, "*" matches any) or If-Range (strong comparison).
  */
-void http_decode_url(char *url);
+int http_match_etag(const char *list, const char *etag, int len, int strong);
+
+/** Parse an HTTP date (IMF-fixdate). The last value is remembered, as
+ * clients send the same one again and again.
+ * @return -1 if it is invalid.
+ */
+time_t http_parse_date(const char *val);
 
 /** Generate HTTP headers for response.
  */
 int http_gen_header(struct response_t *self, char *data, int sz,
         const unsigned int flags);
 
-/** Generate HTTP content for error page.
+/** Generate HTTP header fields only (without status line).
  */
-int http_gen_errorpage(struct response_t *self, char *data, int sz);
+int http_gen_fields(struct response_t *self, char *data, int sz,
+        const unsigned int flags);
+
+/** Generate HTTP headers for response from fields rendered beforehand
+ * (see http_gen_fields), only HTTP_FLAG_DATE, HTTP_FLAG_ENCODING and
+ * HTTP_FLAG_END are added.
+ */
+int http_gen_header_template(struct response_t *self, char *data, int sz,
+        const unsigned int flags, const char *fields, int length);
 
-/** Make url safe by removing relative path.
+/** Generate the boundary and the fields which precede the current part
+ * (content_from, content_length) of a multipart/byteranges response, or
+ * the final boundary after the last one.
  */
-void http_sanitize_url(char *url);
+int http_gen_part(struct response_t *self, char *data, int sz);
+
+/** Generate HTTP content for error page.
+ */
+int http_gen_errorpage(struct response_t *self, char *data, int sz);
 
 /** Convert from request relative url to absolute path in the system.
+ * The url is decoded and made safe in the same pass, request url then
+ * points to it in path (as long as path is in scope).
  * Path buffer's length should be greater than MAX_PATH_LENGTH.
+ * @return length of path, -1 if the url is invalid or too long.
  */
-int http_get_realpath(const char *url, char *path);
+int http_get_realpath(struct request_t *self, char *path);
 
 /** Find the length of request header.
+ * Data before from has already been searched (without success).
+ */
+int http_find_headerlength(const char *data, int len, int from);
+
+/** Check that every supported request header is in the slot given by
+ * its hash (the table is written by hand).
+ * @return name of the first misplaced header, NULL if none.
  */
-int http_find_headerlength(const char *data, int len);
+const char *http_check_headers();
 
 /** Get the status message from HTTP code.
  */
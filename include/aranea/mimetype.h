@@ -10,6 +10,11 @@
  */
 const char *mimetype_get(const char *filename);
 
+/** Check if the type of the file (extension) is not binary, so that
+ * compressing it is worth.
+ */
+int mimetype_compressible(const char *filename);
+
 #endif /* ARANEA_MIMETYPE_H_ */
 
 /* vim: set ts=4 sw=4 expandtab: */
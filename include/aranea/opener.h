@@ -0,0 +1,58 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_OPENER_H_
+#define ARANEA_OPENER_H_
+
+#include <aranea/types.h>
+
+/** Start the threads which open files for the event loops.
+ */
+int opener_init(int num);
+
+/** Stop and join the threads. Must be called before the event loops are
+ * closed (opener_detach).
+ */
+void opener_cleanup();
+
+/** Register the eventfd notifying the server of opened files.
+ */
+int opener_attach(struct server_t *server);
+
+/** Unregister and free jobs of the server.
+ */
+void opener_detach(struct server_t *server);
+
+/** Get a job to be owned by a client of this event loop.
+ * @return NULL if the server has no opener.
+ */
+struct opener_job_t *opener_alloc(struct opener_t *self);
+
+/** Give back the job, it is cancelled if it is still pending.
+ */
+void opener_release(struct opener_job_t *job);
+
+/** Queue job->path to be opened (see client_open_path), its compressed
+ * siblings are looked for too.
+ * @return -1 if the pool is not running.
+ */
+int opener_submit(struct opener_job_t *job, struct client_t *client);
+
+#if HAVE_FILECACHE == 1
+/** Queue a cache entry to be checked against the file system (see
+ * filecache_revalidate), the reference taken for it is released then.
+ * @return -1 if the pool is not running.
+ */
+int opener_revalidate(struct filecache_t *file);
+#endif
+
+/** Pop a client whose file has been opened (client->job holds the result).
+ * @return NULL when there are no more.
+ */
+struct client_t *opener_receive(struct opener_t *self);
+
+#endif /* ARANEA_OPENER_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,61 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_POLLER_H_
+#define ARANEA_POLLER_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <aranea/types.h>
+
+/** Initialize the poller (epoll or select backend).
+ */
+int poller_init(struct poller_t *self);
+
+/** Release resources of the poller.
+ */
+void poller_close(struct poller_t *self);
+
+/** Register a descriptor with POLLER_* interest. Data is returned with
+ * every event of this descriptor.
+ */
+int poller_add(struct poller_t *self, int fd, unsigned int events, void *data);
+
+/** Change the interest of a registered descriptor.
+ */
+int poller_mod(struct poller_t *self, int fd, unsigned int events, void *data);
+
+/** Unregister a descriptor. Must be called before closing it.
+ */
+int poller_del(struct poller_t *self, int fd);
+
+/** Wait for ready descriptors, timeout is in milliseconds (-1: infinite).
+ * @return number of events saved in the given array, -1 on error.
+ */
+int poller_wait(struct poller_t *self, struct poller_event_t *events,
+        int max, int timeout);
+
+/** Accept a connection (non-blocking, close-on-exec) on a listening socket
+ * registered with POLLER_ACCEPT, like accept4.
+ */
+int poller_accept(struct poller_t *self, int fd, struct sockaddr *addr,
+        socklen_t *len);
+
+/** Receive on a socket registered with POLLER_STREAM, like recv. With
+ * io_uring, the data has been received in advance by the kernel.
+ */
+ssize_t poller_recv(struct poller_t *self, int fd, void *buf, size_t len);
+
+/** Send on a socket registered with POLLER_STREAM, like sendmsg. With
+ * io_uring, a copy of the message is sent after the wait: -1 (EAGAIN) is
+ * returned, the same call gives the result after the POLLER_OUT event.
+ */
+ssize_t poller_sendmsg(struct poller_t *self, int fd,
+        const struct msghdr *msg, int flags);
+
+#endif /* ARANEA_POLLER_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -8,13 +8,29 @@
 
 #include <aranea/types.h>
 
-/** Initialize server listening socket.
+/** Create a listening socket on the server port.
+ * @return the socket, -1 on error.
+ */
+int server_listen(struct server_t *self, int reuseport);
+
+/** Initialize server listening socket (if it has not been created) and
+ * the poller.
  */
 int server_init(struct server_t *self);
 
-/** Accept new connection, return the client object to handle it.
+/** Accept new connection, the remote address is written to ip.
+ * @return the non-blocking socket, -1 on error.
+ */
+int server_accept(struct server_t *self, char *ip, int sz);
+
+/** Answer 503 to a connection over the limit and close it.
  */
-struct client_t *server_accept(struct server_t *self);
+void server_reject(int fd);
+
+/** Create a client for an accepted connection, register it and start
+ * reading its request.
+ */
+void server_attach(struct server_t *self, int fd, const char *ip);
 
 /** Listen and handle connections.
  */
@@ -24,6 +40,10 @@ void server_poll(struct server_t *self);
  */
 void server_close_fds();
 
+/** Close and free all clients, the poller and the listening socket.
+ */
+void server_close(struct server_t *self);
+
 #endif /* ARANEA_SERVER_H_ */
 
 /* vim: set ts=4 sw=4 expandtab: */
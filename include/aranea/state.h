@@ -8,17 +8,30 @@
 
 #include <aranea/types.h>
 
+/* Each handler returns 1 if it should be called again (for the new state)
+ * without waiting for the poller, 0 if the socket would block or the
+ * connection is finished (STATE_NONE).
+ */
+
 /** Handler of receiving header.
  */
-void state_recv_header(struct client_t *client);
+int state_recv_header(struct client_t *client);
 
 /** Handler of sending header.
  */
-void state_send_header(struct client_t *client);
+int state_send_header(struct client_t *client);
 
 /** Handler of sending (static) file.
  */
-void state_send_file(struct client_t *client);
+int state_send_file(struct client_t *client);
+
+/** Handler of sending header and file from the file cache.
+ */
+int state_send_memory(struct client_t *client);
+
+/** Handler of sending the parts of a multipart/byteranges response.
+ */
+int state_send_parts(struct client_t *client);
 
 #endif  /* ARANEA_STATE_H_ */
 
@@ -0,0 +1,35 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_THREAD_H_
+#define ARANEA_THREAD_H_
+
+#include <aranea/types.h>
+
+/** Start I/O threads. Each one owns its client list, poller and client
+ * pool (thread local g_server).
+ */
+int thread_init(int num);
+
+/** Accept connections (in the main thread) and hand them to the least
+ * loaded I/O thread.
+ */
+void thread_accept(struct server_t *server);
+
+/** Pop connections handed to the current I/O thread.
+ */
+void thread_receive(struct server_t *server);
+
+/** A connection of this thread is closed.
+ */
+void thread_release(struct thread_t *self);
+
+/** Stop and join all I/O threads.
+ */
+void thread_cleanup();
+
+#endif /* ARANEA_THREAD_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
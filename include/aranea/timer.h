@@ -0,0 +1,37 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_TIMER_H_
+#define ARANEA_TIMER_H_
+
+#include <aranea/types.h>
+
+/** Initialize the timer wheel, now is the current time.
+ */
+void timer_init(struct timerwheel_t *self, time_t now);
+
+/** Schedule the client at client->timeout.
+ * Later changes of the timeout do not need to reschedule the client, it is
+ * moved to the right bucket when its old one expires.
+ */
+void timer_add(struct timerwheel_t *self, struct client_t *client);
+
+/** Unschedule the client (no-op if it is not in the wheel).
+ */
+void timer_remove(struct timerwheel_t *self, struct client_t *client);
+
+/** Advance the wheel to now.
+ * @return list of expired clients (linked by timer_next), they are no
+ *         longer in the wheel.
+ */
+struct client_t *timer_expire(struct timerwheel_t *self, time_t now);
+
+/** Get number of seconds until the next bucket is due, -1 if empty.
+ */
+int timer_next(struct timerwheel_t *self);
+
+#endif /* ARANEA_TIMER_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
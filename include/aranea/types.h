@@ -7,9 +7,14 @@
 #define ARANEA_TYPES_H_
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <aranea/config.h>
 
+#if HAVE_EPOLL == 0
+# include <sys/select.h>
+#endif
+
 enum {
     /* 2xx */
     HTTP_STATUS_OK              = 200,
@@ -27,6 +32,7 @@ enum {
     /* 5xx */
     HTTP_STATUS_SERVERERROR     = 500,
     HTTP_STATUS_NOTIMPLEMENTED  = 501,
+    HTTP_STATUS_SERVICEUNAVAILABLE = 503,
 };
 
 enum {
@@ -34,6 +40,18 @@ enum {
     STATE_RECV_HEADER,          /* read request from socket */
     STATE_SEND_HEADER,          /* write response to socket */
     STATE_SEND_FILE,            /* write file to socket */
+    STATE_SEND_MEMORY,          /* write response and cached file */
+    STATE_OPENING,              /* wait for the file opened by the pool */
+    STATE_SEND_PARTS,           /* write multipart/byteranges to socket */
+};
+
+/* Poller interest and events */
+enum {
+    POLLER_IN                   = 1 << 0,   /* Readable */
+    POLLER_OUT                  = 1 << 1,   /* Writable */
+    POLLER_ET                   = 1 << 2,   /* Edge triggered (epoll only) */
+    POLLER_ACCEPT               = 1 << 3,   /* Listening, see poller_accept */
+    POLLER_STREAM               = 1 << 4,   /* Connected, see poller_recv */
 };
 
 enum {
@@ -48,30 +66,56 @@ enum {
     HTTP_FLAG_CONTENT           = 1 << 2,   /* Content type/length */
     HTTP_FLAG_RANGE             = 1 << 3,   /* Content range */
     HTTP_FLAG_DATE              = 1 << 4,   /* Server date */
+    HTTP_FLAG_ENCODING          = 1 << 5,   /* Content encoding and Vary */
+    HTTP_FLAG_ETAG              = 1 << 6,   /* Without the other content
+                                               fields, for 304 */
+};
+
+/** Content codings (Accept-Encoding)
+ */
+enum {
+    ENCODING_BR                 = 1 << 0,
+    ENCODING_GZIP               = 1 << 1,
+    ENCODING_ZSTD               = 1 << 2,
 };
 
 enum {
     CLIENT_FLAG_HEADERONLY      = 1 << 0,
     CLIENT_FLAG_POST            = 1 << 1,
     CLIENT_FLAG_KEEPALIVE       = 1 << 2,   /* Do not close connection */
+    CLIENT_FLAG_CORKED          = 1 << 3,   /* TCP_CORK is set */
 };
 
 /** HTTP request headers.
- * This should match the array name in http.c
+ * Each one needs a slot in the hash table of http.c
  */
 enum {
 #if HAVE_AUTH == 1
     HEADER_AUTHORIZATION,       /* Authorization */
 #endif
+    HEADER_ACCEPTENCODING,      /* Accept-Encoding */
     HEADER_CONNECTION,          /* Connection */
     HEADER_CONTENTLENGTH,       /* Content-Length */
     HEADER_CONTENTRANGE,        /* Content-Range */
     HEADER_CONTENTTYPE,         /* Content-Type */
     HEADER_COOKIE,              /* Cookie */
+    HEADER_EXPECT,              /* Expect */
+    HEADER_HOST,                /* Host */
     HEADER_IFMODIFIEDSINCE,     /* If-Modified-Since */
+    HEADER_IFNONEMATCH,         /* If-None-Match */
+    HEADER_IFRANGE,             /* If-Range */
+    HEADER_RANGE,               /* Range */
     NUM_REQUEST_HEADER,
 };
 
+/** Byte range of a Range header, -1 for an omitted bound ("500-" or
+ * "-500"), then resolved to the first and last bytes of the file
+ */
+struct range_t {
+    off_t from;
+    off_t to;
+};
+
 /**
  * Pointed to request buffer
  */
@@ -82,8 +126,8 @@ struct request_t {
     char *url;                  /* required */
     char *query_string;
     char *version;              /* required */
-    char *range_from;
-    char *range_to;
+    struct range_t ranges[MAX_RANGES];
+    int num_ranges;     /**< 0 if there is no (valid) Range header */
     ssize_t header_length;
 };
 
@@ -94,6 +138,16 @@ struct response_t {
     off_t content_length;
     off_t content_from;
     time_t last_mod;
+    char etag[MAX_ETAG_LENGTH];     /**< Strong validator, with quotes */
+    int etag_length;    /**< 0 if there is none */
+    const char *content_encoding;   /**< NULL if identity */
+    int vary;           /**< Depends on Accept-Encoding */
+    int num_parts;      /**< Ranges of a multipart/byteranges response */
+    int part;           /**< Being sent, num_parts for the final boundary */
+    char boundary[24];
+#if HAVE_PRECOMPRESSED == 1
+    unsigned int variants;  /**< Compressed siblings of the file */
+#endif
 #if HAVE_AUTH == 1
     const char *realm;
 #endif
@@ -102,6 +156,7 @@ struct response_t {
 struct mimetype_t {
     const char *ext;
     const char *type;
+    int compressible;   /**< Text, see zcache */
 };
 
 struct auth_t {
@@ -112,37 +167,203 @@ struct auth_t {
     struct auth_t *next;
 };
 
+/** Opened static file shared by clients
+ */
+struct filecache_t {
+    char path[MAX_PATH_LENGTH];
+    unsigned int hash;
+    int fd;             /**< -1 if the content is cached */
+    char *content;      /**< Whole file, for small ones */
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    dev_t dev;
+    const char *type;   /**< Mime type */
+    char etag[MAX_ETAG_LENGTH];
+    int etag_length;
+    char header[FILECACHE_HEADER_LENGTH];   /**< Fields of a 200 response */
+    int header_length;  /**< -1 if they do not fit */
+    time_t checked;     /**< Last time the file was checked (stat) */
+    int refs;           /**< Clients sending this file (under the lock) */
+    int stale;          /**< Removed from the cache, closed when released */
+#if HAVE_PRECOMPRESSED == 1
+    unsigned int variants;  /**< Compressed siblings (ENCODING_*) */
+#endif
+#if HAVE_OPENPOOL == 1
+    int checking;       /**< Queued in the pool (under the lock) */
+    struct filecache_t *check_next; /**< Revalidated by the pool */
+#endif
+    struct filecache_t *hnext;      /**< Hash bucket */
+    struct filecache_t *next;       /**< LRU or free list */
+    struct filecache_t *prev;
+};
+
+/** Url which does not exist
+ */
+struct filecache_notfound_t {
+    char url[MAX_PATH_LENGTH];
+    unsigned int hash;
+    time_t expires;
+};
+
+struct filecache_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    size_t memory;      /**< Bytes of cached content */
+};
+
+/** File compressed on the fly, kept in memory (memfd) and shared by the
+ * event loops of the process
+ */
+struct zcache_t {
+    char path[MAX_PATH_LENGTH];
+    unsigned int hash;
+    time_t mtime;       /**< Of the original file */
+    off_t size;
+    unsigned int encoding;      /**< ENCODING_* */
+    int state;          /**< ZCACHE_* */
+    int fd;             /**< Compressed content if ready */
+    off_t length;
+    int refs;           /**< Clients sending it */
+    struct zcache_t *hnext;     /**< Hash bucket */
+    struct zcache_t *next;      /**< LRU, free list or queue */
+    struct zcache_t *prev;
+};
+
+enum {
+    ZCACHE_FREE,
+    ZCACHE_PENDING,     /**< Being compressed */
+    ZCACHE_READY,
+    ZCACHE_FAILED,      /**< Not worth it (or error), not tried again */
+};
+
+struct opener_t;
+
+/** File to open in the pool, owned by a client of the event loop
+ */
+struct opener_job_t {
+    char path[MAX_PATH_LENGTH];
+    int fd;             /**< Opened file, -1 on error */
+    int error;          /**< errno if fd is -1 */
+    struct stat st;
+#if HAVE_PRECOMPRESSED == 1
+    unsigned int variants;  /**< Compressed siblings, probed by the pool */
+#endif
+    int pending;        /**< Queued in the pool */
+    struct client_t *client;    /**< NULL if the client has gone */
+    struct opener_t *owner;     /**< Event loop to notify */
+    struct opener_job_t *next;
+};
+
 struct config_t {
     const char *root;
+    int root_length;    /**< 0 if chroot */
+    int root_fd;        /**< Files are opened relatively to this directory */
+    int backlog;        /**< Listen queue length */
+    int max_conn;       /**< Connections above this are answered with 503 */
 #if HAVE_AUTH == 1
     const char *auth_file;
 #endif
+#if HAVE_WORKER == 1
+    int workers;        /**< Number of worker processes */
+#endif
+#if HAVE_THREAD == 1
+    int threads;        /**< Number of I/O threads */
+#endif
+};
+
+struct poller_event_t {
+    void *data;
+    unsigned int events;
+};
+
+struct uring_t;
+
+struct poller_t {
+#if HAVE_EPOLL == 1
+    int fd;             /**< epoll instance */
+#if HAVE_IOURING == 1
+    struct uring_t *uring;      /**< Used instead of epoll if not NULL */
+#endif
+#else
+    fd_set rfds;
+    fd_set wfds;
+    int max_fd;
+    void *data[FD_SETSIZE];
+#endif
 };
 
 struct client_t {
     int remote_fd;      /**< Socket descriptor */
     int local_rfd;      /**< Reading file/pipe descriptor */
     time_t timeout;
+    struct client_t *timer_next;    /**< Bucket in the timer wheel */
+    struct client_t **timer_prev;
     int state;
+    unsigned int events;    /**< Interest registered to the poller */
     char ip[MAX_IP_LENGTH];
 
     struct request_t request;
     char data[MAX_REQUEST_LENGTH];
+    char path[MAX_PATH_LENGTH];     /**< Requested file (request.url points
+                                      to it), unless it is in job */
     ssize_t data_length;
     ssize_t data_sent;
+    ssize_t data_pipelined;     /**< Received bytes after the header, kept
+                                  at the end of data */
 
     struct response_t response;
     off_t file_sent;
+    off_t quota;        /**< Bytes left to send before the others' turn */
+    unsigned int turn;  /**< Loop in which the quota was given */
+    struct client_t *ready_next;    /**< Waiting for its turn to send */
+    struct client_t **ready_prev;
+#if HAVE_READAHEAD == 1
+    off_t readahead;    /**< End of the pages requested from the disk */
+    off_t dropped;      /**< Start of the sent pages still cached */
+#endif
+#if HAVE_FILECACHE == 1
+    struct filecache_t *file;   /**< Cache entry of local_rfd */
+#endif
+#if HAVE_OPENPOOL == 1
+    struct opener_job_t *job;   /**< Path of the requested file */
+#endif
+#if HAVE_COMPRESS == 1
+    struct zcache_t *zfile;     /**< Compressed variant of local_rfd */
+#endif
 
     unsigned int flags;
     struct client_t *next;
     struct client_t **prev;
 };
 
+/** Timer wheel of client timeouts
+ */
+struct timerwheel_t {
+    time_t now;         /**< Last processed tick */
+    int count;
+    struct client_t *slots[2][TIMER_SLOTS];
+};
+
+struct thread_t;
+
 struct server_t {
     int fd;
     const char *port;
     struct client_t *clients;
+    int num_clients;
+    struct client_t *ready;     /**< Used their quota, served in turn */
+    struct client_t **ready_tail;
+    struct client_t *closed;    /**< Freed by the next loop */
+    unsigned int turn;          /**< Loops, a quota is given once in each */
+    struct poller_t poller;
+    struct timerwheel_t timers;
+#if HAVE_THREAD == 1
+    struct thread_t *thread;    /**< Owner I/O thread */
+#endif
+#if HAVE_OPENPOOL == 1
+    struct opener_t *opener;    /**< Files opened by the pool */
+#endif
 };
 
 #endif /* ARANEA_TYPES_H_ */
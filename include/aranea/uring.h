@@ -0,0 +1,50 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_URING_H_
+#define ARANEA_URING_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <aranea/types.h>
+
+/* io_uring backend of the poller, same semantics as poller_* */
+
+/** Set up a ring.
+ * @return NULL if io_uring is not available, epoll is used then.
+ */
+struct uring_t *uring_init();
+
+void uring_close(struct uring_t *self);
+
+int uring_add(struct uring_t *self, int fd, unsigned int events, void *data);
+
+int uring_mod(struct uring_t *self, int fd, unsigned int events, void *data);
+
+int uring_del(struct uring_t *self, int fd);
+
+/** Next connection of a POLLER_ACCEPT socket, accepted by the kernel.
+ */
+int uring_accept(struct uring_t *self, int fd, struct sockaddr *addr,
+        socklen_t *len);
+
+/** Read the data received in advance on a POLLER_STREAM socket.
+ */
+ssize_t uring_recv(struct uring_t *self, int fd, void *buf, size_t len);
+
+/** Queue a send of a copy of the message, see poller_sendmsg.
+ */
+ssize_t uring_sendmsg(struct uring_t *self, int fd, const struct msghdr *msg,
+        int flags);
+
+/** Submit the queued requests and wait for events.
+ */
+int uring_wait(struct uring_t *self, struct poller_event_t *events,
+        int max, int timeout);
+
+#endif /* ARANEA_URING_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
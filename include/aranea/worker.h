@@ -0,0 +1,22 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_WORKER_H_
+#define ARANEA_WORKER_H_
+
+#include <aranea/types.h>
+
+/** Create one SO_REUSEPORT listening socket per worker, fork the workers
+ * (each one pinned to a CPU) and supervise them: crashed workers are
+ * respawned, SIGQUIT is forwarded.
+ * @return 1 in a worker process, server->fd is its listening socket.
+ *         0 in the supervisor after all workers have quit.
+ *        -1 on error.
+ */
+int worker_run(struct server_t *server, int num);
+
+#endif /* ARANEA_WORKER_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
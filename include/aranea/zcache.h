@@ -0,0 +1,37 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#ifndef ARANEA_ZCACHE_H_
+#define ARANEA_ZCACHE_H_
+
+#include <aranea/types.h>
+
+/** Start the threads which compress files.
+ */
+int zcache_init(int num);
+
+/** Stop the threads and free the cache (entries must have been released).
+ */
+void zcache_cleanup();
+
+/** Get the content codings which can be produced (ENCODING_*).
+ */
+unsigned int zcache_encodings();
+
+/** Look up the compressed variant of a file, identified by its path (as
+ * given by http_get_realpath), modification time and size. If it is not
+ * known yet, it is queued to be compressed for the next requests.
+ * @return the entry with a reference taken, NULL if it is not ready.
+ */
+struct zcache_t *zcache_get(const char *path, time_t mtime, off_t size,
+        unsigned int encoding);
+
+/** Drop a reference.
+ */
+void zcache_release(struct zcache_t *self);
+
+#endif /* ARANEA_ZCACHE_H_ */
+
+/* vim: set ts=4 sw=4 expandtab: */
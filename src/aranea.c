@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <signal.h>
@@ -25,13 +26,13 @@
 
 /* global vars */
 /** Current time: used in HTTP date and server timeout checking */
-time_t g_curtime;
+A_TLS time_t g_curtime;
 /** System settings */
 struct config_t g_config;
 /** General purpose buffer */
-char g_buff[GBUFF_LENGTH];
-/** Server socket */
-struct server_t g_server;
+A_TLS char g_buff[GBUFF_LENGTH];
+/** Server socket (and clients of the I/O thread) */
+A_TLS struct server_t g_server;
 
 static unsigned int flags_ = 0;
 
@@ -43,13 +44,23 @@ void print_help(const char *name) {
 #if HAVE_AUTH == 1
             "  -a AUTH_FILE         Authentication file\n"
 #endif
+            "  -b BACKLOG           Length of the listen queue\n"
+            "  -c MAX_CONN          Maximum number of connections\n"
             "  -d                   Run as daemon (background) mode\n"
             "  -p PORT              Server listening port\n"
             "  -r DOCUMENT_ROOT     Server root (absolute path)\n"
+#if HAVE_THREAD == 1
+            "  -t NUM               Number of I/O threads\n"
+#endif
+#if HAVE_WORKER == 1
+            "  -w NUM               Number of worker processes\n"
+#endif
             );
 
-    fprintf(stdout, "Version: %s (AUTH=%d CGI=%d CHROOT=%d VFORK=%d)\n",
-            ARANEA_VERSION, HAVE_AUTH, HAVE_CGI, HAVE_CHROOT, HAVE_VFORK);
+    fprintf(stdout, "Version: %s (AUTH=%d CGI=%d CHROOT=%d VFORK=%d EPOLL=%d "
+            "WORKER=%d THREAD=%d)\n",
+            ARANEA_VERSION, HAVE_AUTH, HAVE_CGI, HAVE_CHROOT, HAVE_VFORK,
+            HAVE_EPOLL, HAVE_WORKER, HAVE_THREAD);
 
     exit(0);
 }
@@ -60,7 +71,11 @@ int parse_options(int argc, char **argv) {
 
     /* default settings */
     g_server.port = PORT;
+    g_server.fd = -1;
     g_config.root = ".";                /* current dir */
+    g_config.root_fd = -1;
+    g_config.backlog = LISTEN_BACKLOG;
+    g_config.max_conn = MAX_CONN;
 
     for (i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
@@ -72,6 +87,28 @@ int parse_options(int argc, char **argv) {
                 g_config.auth_file = argv[i];
                 break;
 #endif
+            case 'b':
+                ++i;
+                CHECK_OPTION_(argv[i], 'b');
+                g_config.backlog = atoi(argv[i]);
+                if (g_config.backlog < 1
+                        || g_config.backlog > LISTEN_BACKLOG_LIMIT) {
+                    fprintf(stderr, "Backlog must be 1-%d.\n",
+                            LISTEN_BACKLOG_LIMIT);
+                    return -1;
+                }
+                break;
+            case 'c':
+                ++i;
+                CHECK_OPTION_(argv[i], 'c');
+                g_config.max_conn = atoi(argv[i]);
+                if (g_config.max_conn < 1
+                        || g_config.max_conn > MAX_CONN_LIMIT) {
+                    fprintf(stderr, "Number of connections must be 1-%d.\n",
+                            MAX_CONN_LIMIT);
+                    return -1;
+                }
+                break;
             case 'd':
                 flags_ |= FLAG_DAEMON;
                 break;
@@ -88,6 +125,30 @@ int parse_options(int argc, char **argv) {
                 CHECK_OPTION_(argv[i], 'r');
                 g_config.root = argv[i];
                 break;
+#if HAVE_THREAD == 1
+            case 't':
+                ++i;
+                CHECK_OPTION_(argv[i], 't');
+                g_config.threads = atoi(argv[i]);
+                if (g_config.threads < 0 || g_config.threads > MAX_THREADS) {
+                    fprintf(stderr, "Number of threads must be 0-%d.\n",
+                            MAX_THREADS);
+                    return -1;
+                }
+                break;
+#endif
+#if HAVE_WORKER == 1
+            case 'w':
+                ++i;
+                CHECK_OPTION_(argv[i], 'w');
+                g_config.workers = atoi(argv[i]);
+                if (g_config.workers < 0 || g_config.workers > MAX_WORKERS) {
+                    fprintf(stderr, "Number of workers must be 0-%d.\n",
+                            MAX_WORKERS);
+                    return -1;
+                }
+                break;
+#endif
             }
         }
     }
@@ -113,7 +174,17 @@ int init_conf() {
         A_ERR("Could not chroot to %s", g_config.root);
         return -1;
     }
+    g_config.root_fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    g_config.root_length = 0;
+#else
+    g_config.root_fd = open(g_config.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    g_config.root_length = strlen(g_config.root);
 #endif
+    /* requested files are looked up from here, not from / */
+    if (g_config.root_fd == -1) {
+        A_ERR("Could not open %s: %s", g_config.root, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
@@ -143,24 +214,47 @@ int init_signal() {
         A_ERR("sigaction %s", strerror(errno));
         return -1;
     }
+    /* sendfile() has no MSG_NOSIGNAL, the peer may close while sending */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) < 0) {
+        A_ERR("sigaction %s", strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
 static
 void cleanup() {
-    struct client_t *c, *tc;
+#if HAVE_FILECACHE == 1
+    struct filecache_stats_t stats;
+#endif
 
+#if HAVE_OPENPOOL == 1
+    /* before the event loops which receive the opened files */
+    opener_cleanup();
+#endif
+#if HAVE_THREAD == 1
+    if (g_config.threads > 0) {
+        thread_cleanup();
+    }
+#endif
 #if HAVE_AUTH == 1
     auth_cleanup();
 #endif
-
-    for (c = g_server.clients; c != NULL; ) {
-        tc = c;
-        c = c->next;
-        client_close(tc);
-        free(tc);
-    }
+    server_close(&g_server);
     clientpool_cleanup();
+#if HAVE_FILECACHE == 1
+    /* also in release builds, to size FILECACHE_* */
+    filecache_stats(&stats);
+    A_ERR("filecache: %lu hits %lu misses %lu bytes in memory",
+            stats.hits, stats.misses, (unsigned long)stats.memory);
+    filecache_cleanup();
+#endif
+#if HAVE_COMPRESS == 1
+    /* after the clients which were sending compressed files */
+    zcache_cleanup();
+#endif
+    close(g_config.root_fd);
 }
 
 static
@@ -227,13 +321,50 @@ int main(int argc, char **argv) {
     if (init_conf() != 0) {
         return 1;
     }
+#if HAVE_WORKER == 1
+    /* the supervisor returns here when all workers have quit */
+    if (g_config.workers > 0) {
+        switch (worker_run(&g_server, g_config.workers)) {
+        case 0:
+            return 0;
+        case 1:
+            break;                  /* worker process */
+        default:
+            return 1;
+        }
+    }
+#endif
     /* initialize signal handlers */
     if (init_signal() != 0) {
         return 1;
     }
+#if HAVE_OPENPOOL == 1
+    /* per process, threads do not survive fork */
+    if (opener_init(OPENPOOL_THREADS) != 0) {
+        return 1;
+    }
+#endif
+#if HAVE_COMPRESS == 1
+    if (zcache_init(ZCACHE_THREADS) != 0) {
+        return 1;
+    }
+#endif
     if (server_init(&g_server) != 0) {
         return 1;
     }
+#if HAVE_THREAD == 1
+    /* the main thread only accepts connections */
+    if (g_config.threads > 0) {
+        if (thread_init(g_config.threads) != 0) {
+            return 1;
+        }
+        while (!(flags_ & FLAG_QUIT)) {
+            thread_accept(&g_server);
+        }
+        cleanup();
+        return 0;
+    }
+#endif
     /* main loop */
     while (!(flags_ & FLAG_QUIT)) {
         server_poll(&g_server);
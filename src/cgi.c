@@ -9,6 +9,8 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
@@ -108,6 +110,119 @@ int cgi_gen_env(const struct request_t *req, char **env) {
 # define EXIT_(x)       exit(x)
 #endif  /* HAVE_VFORK */
 
+/** Write all data to the file descriptor
+ */
+static
+int cgi_write(int fd, const char *data, ssize_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** Write the body bytes already received then copy the rest of the body
+ * from the socket.
+ */
+static
+int cgi_copy_body(int fd, struct client_t *client, const char *body,
+        ssize_t len, long rest) {
+    char buf[MAX_REQUEST_LENGTH];       /* g_buff holds the environment */
+    ssize_t n;
+
+    if (cgi_write(fd, body, len) != 0) {
+        return -1;
+    }
+    while (rest > 0) {
+        n = read(client->remote_fd, buf,
+                (rest < (long)sizeof(buf)) ? rest : (long)sizeof(buf));
+        if (n <= 0 || cgi_write(fd, buf, n) != 0) {
+            return -1;
+        }
+        rest -= n;
+    }
+    return 0;
+}
+
+/** Tie CGI's stdin to a pipe which is fed with the body bytes already
+ * received with the header (kept at the end of client->data) followed by
+ * the rest of the body from the socket.
+ * Called in the child process.
+ */
+static
+int cgi_pipe_body(struct client_t *client) {
+    const char *body;
+    ssize_t len;
+    long rest;
+    int fds[2];
+#if HAVE_VFORK == 1
+    char tmpl[] = "/tmp/aranea.XXXXXX";
+#else
+    pid_t pid;
+#endif
+
+    body = client->data + sizeof(client->data) - client->data_pipelined;
+    len = client->data_pipelined;
+    rest = 0;
+    if (client->request.header[HEADER_CONTENTLENGTH] != NULL) {
+        rest = strtol(client->request.header[HEADER_CONTENTLENGTH], NULL, 10);
+    }
+    if (len > rest) {
+        len = rest;
+    }
+    rest -= len;
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    if (len + rest <= PIPE_BUF) {
+        /* the pipe can hold the whole body */
+        alarm(CLIENT_TIMEOUT);
+        if (cgi_copy_body(fds[1], client, body, len, rest) != 0) {
+            return -1;
+        }
+        alarm(0);
+    } else {
+#if HAVE_VFORK == 1
+        /* no process can relay a large body, spool it to a file while
+         * the server is suspended */
+        close(fds[0]);
+        fds[0] = mkstemp(tmpl);
+        if (fds[0] < 0) {
+            return -1;
+        }
+        unlink(tmpl);
+        alarm(CLIENT_TIMEOUT);
+        if (cgi_copy_body(fds[0], client, body, len, rest) != 0
+                || lseek(fds[0], 0, SEEK_SET) != 0) {
+            return -1;
+        }
+        alarm(0);
+#else
+        pid = fork();
+        if (pid < 0) {
+            return -1;
+        }
+        if (pid == 0) {                         /* relay */
+            close(fds[0]);
+            alarm(CLIENT_TIMEOUT);              /* do not wait forever */
+            _exit(cgi_copy_body(fds[1], client, body, len, rest) != 0);
+        }
+#endif
+    }
+    close(fds[1]);
+    if (dup2(fds[0], STDIN_FILENO) < 0) {
+        return -1;
+    }
+    close(fds[0]);
+    return 0;
+}
+
 /** Execute file.
  * HTTP error code is set to client->response.status_code.
  */
@@ -138,13 +253,18 @@ int cgi_exec(const char *path, struct client_t *client) {
         /* Send minimal header */
         client->response.status_code = HTTP_STATUS_OK;
         client->data_length = http_gen_header(&client->response, client->data,
-                sizeof(client->data), 0);
+                CLIENT_DATA_FREE(client), 0);
         if (send(client->remote_fd, client->data, client->data_length, 0) < 0) {
             EXIT_(1);
         }
-        /* Tie CGI's stdin to the socket */
+        /* Tie CGI's stdin to the socket, or to a pipe if a part of the
+         * body has been received with the header */
         if (client->flags & CLIENT_FLAG_POST) {
-            if (dup2(client->remote_fd, STDIN_FILENO) < 0) {
+            if (client->data_pipelined > 0) {
+                if (cgi_pipe_body(client) != 0) {
+                    EXIT_(1);
+                }
+            } else if (dup2(client->remote_fd, STDIN_FILENO) < 0) {
                 EXIT_(1);
             }
         }
@@ -160,7 +280,8 @@ int cgi_exec(const char *path, struct client_t *client) {
             dup2(newio, STDERR_FILENO);
             close(newio);
         }
-        /* Execute cgi script */
+        /* Execute cgi script, SIGPIPE is ignored by the server only */
+        signal(SIGPIPE, SIG_DFL);
         argv[0] = (char *)path;
         argv[1] = NULL;
         execve(path, argv, envp);
@@ -178,7 +299,7 @@ int cgi_process(struct client_t *client, const char *path) {
     if (client->flags & CLIENT_FLAG_HEADERONLY) {
         client->response.status_code = HTTP_STATUS_OK;
         client->data_length = http_gen_header(&client->response, client->data,
-                sizeof(client->data), HTTP_FLAG_END);
+                CLIENT_DATA_FREE(client), HTTP_FLAG_END);
         client->state = STATE_SEND_HEADER;
         return 0;
     }
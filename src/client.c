@@ -11,6 +11,10 @@
 #include <time.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#if HAVE_OPENAT2 == 1
+# include <sys/syscall.h>
+# include <linux/openat2.h>
+#endif
 
 #include <aranea/aranea.h>
 
@@ -20,6 +24,30 @@
         fd = -1;                \
     } while (0)
 
+#if HAVE_FILECACHE == 1
+/** Answer to urls of the negative cache, rendered once */
+static A_TLS char notfound_[256];
+static A_TLS int notfound_length_ = 0;
+static A_TLS int notfound_header_ = 0;  /**< Without the page, for HEAD */
+#endif
+/** Numbers the boundaries of multipart/byteranges responses */
+static A_TLS unsigned long parts_ = 0;
+
+#if HAVE_PRECOMPRESSED == 1
+struct client_variant_t {
+    unsigned int encoding;
+    const char *name;   /**< Content-Encoding */
+    const char *ext;    /**< Appended to the path of the file */
+};
+
+/** Precompressed siblings, the preferred one first */
+static
+const struct client_variant_t CLIENT_VARIANTS[] = {
+        { ENCODING_BR,      "br",       ".br" },
+        { ENCODING_GZIP,    "gzip",     ".gz" },
+};
+#endif
+
 void client_add(struct client_t *self, struct client_t **list) {
     if (*list == NULL) {
         self->next = NULL;
@@ -38,13 +66,39 @@ void client_detach(struct client_t *self) {
     *(self->prev) = self->next;
 }
 
+void client_close_file(struct client_t *self) {
+#if HAVE_COMPRESS == 1
+    if (self->zfile != NULL) {
+        zcache_release(self->zfile);
+        self->zfile = NULL;
+        self->local_rfd = -1;
+        return;
+    }
+#endif
+#if HAVE_FILECACHE == 1
+    if (self->file != NULL) {
+        filecache_release(self->file);
+        self->file = NULL;
+        self->local_rfd = -1;
+        return;
+    }
+#endif
+    if (self->local_rfd != -1) {
+        CLIENT_CLOSEFD_(self->local_rfd);
+    }
+}
+
 void client_close(struct client_t *self) {
     if (self->remote_fd != -1) {
         CLIENT_CLOSEFD_(self->remote_fd);
     }
-    if (self->local_rfd != -1) {
-        CLIENT_CLOSEFD_(self->local_rfd);
+    client_close_file(self);
+#if HAVE_OPENPOOL == 1
+    if (self->job != NULL) {
+        opener_release(self->job);
+        self->job = NULL;
     }
+#endif
 }
 
 /** Set client to initial state
@@ -52,6 +106,17 @@ void client_close(struct client_t *self) {
 void client_init(struct client_t *self) {
     self->remote_fd = -1;
     self->local_rfd = -1;
+#if HAVE_FILECACHE == 1
+    self->file = NULL;
+#endif
+#if HAVE_OPENPOOL == 1
+    self->job = NULL;
+#endif
+#if HAVE_COMPRESS == 1
+    self->zfile = NULL;
+#endif
+    self->timer_prev = NULL;
+    self->ready_prev = NULL;
     self->ip[0] = '\0';
     self->state = STATE_NONE;
     client_reset(self);
@@ -62,24 +127,100 @@ void client_init(struct client_t *self) {
 void client_reset(struct client_t *self) {
     self->data_length = 0;
     self->data_sent = 0;
+    self->data_pipelined = 0;
     self->file_sent = 0;
+#if HAVE_READAHEAD == 1
+    self->readahead = 0;
+    self->dropped = 0;
+#endif
     self->flags = 0;
     memset(&self->request, 0, sizeof(self->request));
     memset(&self->response, 0, sizeof(self->response));
 }
 
-/** Open and get file information
- * Set response.status_code on error.
+/** Path (as given by http_get_realpath) relative to the document root,
+ * so that the root prefix is not walked again.
  */
 static
-int client_open_file(struct client_t *self, const char *path) {
-    struct stat st;
+const char *client_relpath(const char *path) {
+    path += g_config.root_length;
+    while (*path == '/') {
+        ++path;
+    }
+    return path;
+}
+
+/** Open path relatively to the document root. With openat2, the kernel
+ * refuses to leave the root, e.g. through a symbolic link.
+ */
+static
+int client_openat(const char *path) {
+    const int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+#if HAVE_OPENAT2 == 1
+    static A_TLS int openat2_ = 1;      /* until the kernel says ENOSYS */
+    struct open_how how;
+    int fd;
+#endif
+
+    path = client_relpath(path);
+#if HAVE_OPENAT2 == 1
+    if (openat2_) {
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        fd = syscall(SYS_openat2, g_config.root_fd, path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        openat2_ = 0;
+    }
+#endif
+    return openat(g_config.root_fd, path, flags);
+}
+
+int client_open_path(const char *path, struct stat *st) {
+    int fd, err;
 
-    self->local_rfd = open(path, O_RDONLY | O_NONBLOCK);
-    if (self->local_rfd == -1) {
-        A_ERR("open: %s %s", path, strerror(errno));
-        switch (errno) {
+    fd = client_openat(path);
+    if (fd == -1) {
+        return -1;
+    }
+    /* get information */
+    if (fstat(fd, st) == -1) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    /* make sure it's a regular file */
+    if (S_ISDIR(st->st_mode) || !S_ISREG(st->st_mode)) {
+        A_ERR("not a regular file 0x%x", st->st_mode);
+        close(fd);
+        errno = EACCES;
+        return -1;
+    }
+#if HAVE_READAHEAD == 1
+    /* larger readahead window for this descriptor (shared by the cache) */
+    if (st->st_size >= READAHEAD_MIN_LENGTH) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+    return fd;
+}
+
+/** Take the file opened by client_open_path (err is its errno), variants
+ * are its compressed siblings (client_probe_variants).
+ * Set response.status_code on error.
+ */
+static
+int client_use_file(struct client_t *self, const char *path, int fd,
+        const struct stat *st, int err, unsigned int variants) {
+    if (fd == -1) {
+        A_ERR("open: %s %s", path, strerror(err));
+        switch (err) {
         case EACCES:
+        case EXDEV:                     /* out of the document root */
+        case ELOOP:
             self->response.status_code = HTTP_STATUS_FORBIDDEN;
             break;
         case ENOENT:
@@ -91,103 +232,583 @@ int client_open_file(struct client_t *self, const char *path) {
         }
         return -1;
     }
-    /* get information */
-    if (fstat(self->local_rfd, &st) == -1) {
-        A_ERR("stat: %s", strerror(errno));
-        self->response.status_code = HTTP_STATUS_SERVERERROR;
-        goto err;
-    }
-    /* make sure it's a regular file */
-    if (S_ISDIR(st.st_mode) || !S_ISREG(st.st_mode)) {
-        A_ERR("not a regular file 0x%x", st.st_mode);
-        self->response.status_code = HTTP_STATUS_FORBIDDEN;
-        goto err;
-    }
-    self->response.last_mod = st.st_mtime;
-    self->response.total_length = st.st_size;
-    self->response.content_length = st.st_size;
+    self->local_rfd = fd;
+    self->response.last_mod = st->st_mtime;
+    self->response.etag_length = http_gen_etag(self->response.etag,
+            sizeof(self->response.etag), st);
+    self->response.total_length = st->st_size;
+    self->response.content_length = st->st_size;
     self->response.content_type = mimetype_get(path);
     self->response.content_from = 0;
+#if HAVE_PRECOMPRESSED == 1
+    self->response.variants = variants;
+#else
+    (void)variants;
+#endif
+#if HAVE_FILECACHE == 1
+    self->file = filecache_put(path, self->local_rfd, st,
+            self->response.content_type, variants);
+    if (self->file != NULL) {
+        self->local_rfd = self->file->fd;   /* closed if read in memory */
+    }
+#endif
+    return 0;
+}
+
+#if HAVE_FILECACHE == 1
+/** Take a reference of the cache entry (see filecache_get).
+ */
+static
+void client_use_entry(struct client_t *self, struct filecache_t *file) {
+    self->file = file;
+    self->local_rfd = file->fd;
+    self->response.last_mod = file->mtime;
+    memcpy(self->response.etag, file->etag, file->etag_length);
+    self->response.etag_length = file->etag_length;
+    self->response.total_length = file->size;
+    self->response.content_length = file->size;
+    self->response.content_type = file->type;
+    self->response.content_from = 0;
+#if HAVE_PRECOMPRESSED == 1
+    self->response.variants = file->variants;
+#endif
+}
+#endif
+
+/** Open and get file information
+ * Set response.status_code on error.
+ * @return 1 if the file is being opened by the pool (see client_opened).
+ */
+static
+int client_open_file(struct client_t *self, const char *path) {
+    struct stat st;
+    unsigned int variants = 0;
+    int fd;
+
+#if HAVE_FILECACHE == 1
+    self->file = filecache_get(path);
+    if (self->file != NULL) {
+        client_use_entry(self, self->file);
+        return 0;
+    }
+#endif
+#if HAVE_OPENPOOL == 1
+    /* path is in the job */
+    if (self->job != NULL && opener_submit(self->job, self) == 0) {
+        self->state = STATE_OPENING;
+        return 1;
+    }
+#endif
+    fd = client_open_path(path, &st);
+    if (fd == -1) {
+        return client_use_file(self, path, fd, &st, errno, 0);
+    }
+#if HAVE_PRECOMPRESSED == 1
+    variants = client_probe_variants(path, st.st_mtime);
+#endif
+    return client_use_file(self, path, fd, &st, 0, variants);
+}
+
+#if HAVE_PRECOMPRESSED == 1
+unsigned int client_probe_variants(const char *path, time_t mtime) {
+    char vpath[MAX_PATH_LENGTH];
+    struct stat st;
+    unsigned int i, found;
+    size_t len;
+
+    len = strlen(path);
+    found = 0;
+    for (i = 0; i < A_SIZEOF(CLIENT_VARIANTS); ++i) {
+        if (len + strlen(CLIENT_VARIANTS[i].ext) >= sizeof(vpath)) {
+            continue;
+        }
+        memcpy(vpath, path, len);
+        strcpy(vpath + len, CLIENT_VARIANTS[i].ext);
+        if (fstatat(g_config.root_fd, client_relpath(vpath), &st, 0) == 0
+                && S_ISREG(st.st_mode) && st.st_mtime >= mtime) {
+            found |= CLIENT_VARIANTS[i].encoding;
+        }
+    }
+    return found;
+}
+
+/** Replace the opened file by its compressed sibling path.
+ * @return -1 if it cannot be opened, the file is kept then.
+ */
+static
+int client_open_variant(struct client_t *self, const char *path) {
+    const char *type = self->response.content_type;
+    struct stat st;
+    int fd;
+
+#if HAVE_FILECACHE == 1
+    struct filecache_t *file;
+
+    file = filecache_get(path);
+    if (file != NULL) {
+        client_close_file(self);
+        client_use_entry(self, file);
+        self->response.content_type = type;
+        return 0;
+    }
+#endif
+    fd = client_open_path(path, &st);
+    if (fd == -1) {
+        return -1;
+    }
+    client_close_file(self);
+    client_use_file(self, path, fd, &st, 0, 0);
+    self->response.content_type = type;
     return 0;
+}
 
-err:
-    CLIENT_CLOSEFD_(self->local_rfd);
+/** Send the precompressed sibling of the opened file (path) if there is one
+ * in accepted. Siblings are looked for when the file is opened (and
+ * checked again with a cached file), so a hit costs no system call.
+ * @return 0 if the sibling is sent.
+ */
+static
+int client_use_sibling(struct client_t *self, const char *path,
+        unsigned int accepted) {
+    char vpath[MAX_PATH_LENGTH];
+    unsigned int i, variants;
+    size_t len;
+
+    variants = self->response.variants;
+    if (variants == 0) {
+        return -1;
+    }
+    self->response.vary = 1;
+    variants &= accepted;
+    len = strlen(path);
+    for (i = 0; variants != 0 && i < A_SIZEOF(CLIENT_VARIANTS); ++i) {
+        if ((variants & CLIENT_VARIANTS[i].encoding) == 0) {
+            continue;
+        }
+        memcpy(vpath, path, len);
+        strcpy(vpath + len, CLIENT_VARIANTS[i].ext);    /* probed */
+        if (client_open_variant(self, vpath) == 0) {
+            self->response.content_encoding = CLIENT_VARIANTS[i].name;
+            return 0;
+        }
+    }
     return -1;
 }
+#endif  /* HAVE_PRECOMPRESSED */
+
+#if HAVE_COMPRESS == 1
+/** Add the coding to the entity tag of the file, the compressed variant
+ * is another representation (a sibling has its own inode).
+ */
+static
+void client_tag_encoding(struct response_t *response) {
+    int len, n;
+
+    len = response->etag_length;
+    n = strlen(response->content_encoding);
+    if (len < 2 || len + n + 1 >= (int)sizeof(response->etag)) {
+        response->etag_length = 0;
+        return;
+    }
+    /* "ino-size-mtime" -> "ino-size-mtime-gzip" */
+    response->etag[len - 1] = '-';
+    memcpy(response->etag + len, response->content_encoding, n);
+    response->etag[len + n] = '"';
+    response->etag_length = len + n + 1;
+}
 
+/** Send the opened file (path) compressed on the fly if it is text and the
+ * client accepts it. The first requests get the file as is while it is
+ * compressed by the pool of zcache.
+ * @return 0 if the compressed variant is sent.
+ */
+static
+int client_use_compressed(struct client_t *self, const char *path,
+        unsigned int accepted) {
+    struct zcache_t *z;
+    unsigned int encoding;
+
+    if (self->response.total_length < ZCACHE_MIN_LENGTH
+            || self->response.total_length > ZCACHE_MAX_LENGTH
+            || !mimetype_compressible(path)) {
+        return -1;
+    }
+    self->response.vary = 1;
+    accepted &= zcache_encodings();
+    encoding = (accepted & ENCODING_ZSTD) ? ENCODING_ZSTD
+            : (accepted & ENCODING_GZIP);
+    if (encoding == 0) {
+        return -1;
+    }
+    z = zcache_get(path, self->response.last_mod,
+            self->response.total_length, encoding);
+    if (z == NULL) {
+        return -1;
+    }
+    client_close_file(self);
+    self->zfile = z;
+    self->local_rfd = z->fd;
+    self->response.total_length = z->length;
+    self->response.content_length = z->length;
+    self->response.content_encoding =
+            (encoding == ENCODING_ZSTD) ? "zstd" : "gzip";
+    client_tag_encoding(&self->response);
+    return 0;
+}
+#endif  /* HAVE_COMPRESS */
+
+#if HAVE_PRECOMPRESSED == 1 || HAVE_COMPRESS == 1
+/** Choose the representation of the opened file (path): a precompressed
+ * sibling first, then the file compressed on the fly.
+ */
+static
+void client_select_encoding(struct client_t *self, const char *path) {
+    unsigned int accepted;
+
+    accepted = http_parse_encoding(self->request.header[HEADER_ACCEPTENCODING]);
+#if HAVE_PRECOMPRESSED == 1
+    if (client_use_sibling(self, path, accepted) == 0) {
+        return;
+    }
+#endif
+#if HAVE_COMPRESS == 1
+    client_use_compressed(self, path, accepted);
+#endif
+}
+#endif
+
+/** Check the validators of a conditional request, If-None-Match takes
+ * precedence over If-Modified-Since.
+ * @return 0 if the client has the file already (304), 1 if there are no
+ *         validators.
+ */
 static
 int client_check_filemod(struct client_t *self) {
-    char date[MAX_DATE_LENGTH];
-    int len;
+    const char *val;
+    time_t t;
 
-    if (self->request.header[HEADER_IFMODIFIEDSINCE] == NULL) {
+    val = self->request.header[HEADER_IFNONEMATCH];
+    if (val != NULL) {
+        return http_match_etag(val, self->response.etag,
+                self->response.etag_length, 0) ? 0 : -1;
+    }
+    val = self->request.header[HEADER_IFMODIFIEDSINCE];
+    if (val == NULL) {
         return 1;
     }
-    len = strftime(date, sizeof(date), DATE_FORMAT,
-            gmtime(&self->response.last_mod));
-    if (strncmp(self->request.header[HEADER_IFMODIFIEDSINCE], date, len) == 0) {
+    t = http_parse_date(val);
+    if (t != -1 && self->response.last_mod <= t) {
         return 0;
     }
     return -1;
 }
 
+/** Check If-Range, the range is only sent if the file has not changed.
+ * @return 0 if the Range header is to be ignored.
+ */
+static
+int client_check_ifrange(struct client_t *self) {
+    const char *val = self->request.header[HEADER_IFRANGE];
+
+    if (val == NULL) {
+        return 1;
+    }
+    if (*val == '"' || *val == 'W') {
+        return http_match_etag(val, self->response.etag,
+                self->response.etag_length, 1);
+    }
+    return http_parse_date(val) == self->response.last_mod;
+}
+
 /**
- * Convert FROM-TO to FROM/TOTAL
+ * Resolve the ranges against the file, the unsatisfiable ones are dropped:
+ * 0-99 = 0/100, 4- = 4/96 and -10 = 90/10 of 100 bytes.
+ * They are sorted, and the overlapping or adjacent ones are merged.
  * Set response.status_code on error.
+ * @return 0 if there are ranges to send (response.num_parts), 1 if there
+ *         are none or several cover the whole file.
  */
 static
 int client_check_filerange(struct client_t *self) {
-    off_t pos;
+    struct range_t *r = self->request.ranges;
+    struct range_t tmp;
+    off_t size = self->response.content_length;
+    off_t from, to;
+    int i, j, n;
 
-    if (self->request.range_from != NULL) {
-        self->response.content_from = strtol(self->request.range_from, NULL, 10);
-
-        if (self->response.content_from >= self->response.content_length) {
-            goto err;
-        }
-        if (self->request.range_to != NULL) {
-            /* 0-99 = 0/100 */
-            pos = strtol(self->request.range_to, NULL, 10);
-            if (pos < self->response.content_from) {
-                goto err;
+    if (self->request.num_ranges == 0) {
+        return 1;
+    }
+    for (i = 0, n = 0; i < self->request.num_ranges; ++i) {
+        if (r[i].from < 0) {                    /* suffix */
+            /* nothing to send of an empty file: 416 */
+            if (r[i].to == 0 || size == 0) {
+                continue;
             }
-            self->response.content_length = pos - self->response.content_from + 1;
-        } else {                                /* To is not given */
-            /* 4- = 4/95 */
-            self->response.content_length -= self->response.content_from - 1;
+            from = (r[i].to < size) ? size - r[i].to : 0;
+            to = size - 1;
+        } else if (r[i].from < size) {
+            from = r[i].from;
+            to = (r[i].to < 0 || r[i].to >= size) ? size - 1 : r[i].to;
+        } else {
+            continue;
         }
-    } else {                                    /* From is not given */
-        if (self->request.range_to != NULL) {
-            /* -10 = 89/10 */
-            pos = strtol(self->request.range_to, NULL, 10);
-            if (pos >= self->response.content_length) {
-                goto err;
+        r[n].from = from;
+        r[n].to = to;
+        ++n;
+    }
+    if (n == 0) {
+        self->response.status_code = HTTP_STATUS_RANGENOTSATISFIABLE;
+        return -1;
+    }
+    /* "0-,0-" must not send the file twice */
+    for (i = 1; i < n; ++i) {
+        tmp = r[i];
+        for (j = i; j > 0 && r[j - 1].from > tmp.from; --j) {
+            r[j] = r[j - 1];
+        }
+        r[j] = tmp;
+    }
+    for (i = 1, j = 0; i < n; ++i) {
+        if (r[i].from <= r[j].to + 1) {
+            if (r[i].to > r[j].to) {
+                r[j].to = r[i].to;
             }
-            self->response.content_from = self->response.content_length - pos;
-            self->response.content_length = pos;
         } else {
-            return 1;                           /* not available */
+            r[++j] = r[i];
         }
     }
-    A_LOG("from=%ld len=%ld", self->response.content_from,
+    if (n > 1 && j == 0 && r[0].from == 0 && r[0].to == size - 1) {
+        return 1;
+    }
+    n = j + 1;
+    self->request.num_ranges = n;
+    self->response.num_parts = n;
+    self->response.content_from = r[0].from;
+    self->response.content_length = r[0].to - r[0].from + 1;
+    A_LOG("ranges=%d from=%ld len=%ld", n, self->response.content_from,
             self->response.content_length);
     return 0;
-err:
-    self->response.status_code = HTTP_STATUS_RANGENOTSATISFIABLE;
-    return -1;
+}
+
+/** Point the response to the range of a part.
+ */
+static
+void client_set_part(struct client_t *self, int part) {
+    const struct range_t *r = &self->request.ranges[part];
+
+    self->response.part = part;
+    if (part < self->response.num_parts) {
+        self->response.content_from = r->from;
+        self->response.content_length = r->to - r->from + 1;
+    }
+}
+
+int client_next_part(struct client_t *self) {
+    int len;
+
+    client_set_part(self, self->response.part + 1);
+    len = http_gen_part(&self->response, self->data + self->data_length,
+            CLIENT_DATA_FREE(self) - self->data_length);
+    if (len < 0) {
+        return -1;
+    }
+    self->data_length += len;
+    return 0;
+}
+
+/** Answer with multipart/byteranges. Its length is counted with the
+ * boundary and fields of every part, which are then rendered in turn by
+ * state_send_parts between the ranges.
+ */
+static
+int client_respond_parts(struct client_t *self) {
+    struct response_t *r = &self->response;
+    char buf[MAX_PART_LENGTH];
+    off_t length;
+    int i, len;
+
+    snprintf(r->boundary, sizeof(r->boundary), "%010lu%010lu",
+            (unsigned long)g_curtime, ++parts_);
+    length = 0;
+    for (i = 0; i <= r->num_parts; ++i) {
+        client_set_part(self, i);
+        len = http_gen_part(r, buf, sizeof(buf));
+        if (len < 0) {
+            client_close_file(self);
+            r->num_parts = 0;
+            r->status_code = HTTP_STATUS_SERVERERROR;
+            return -1;
+        }
+        length += len;
+        if (i < r->num_parts) {
+            length += r->content_length;
+        }
+    }
+    r->content_length = length;
+    r->status_code = HTTP_STATUS_PARTIALCONTENT;
+    self->data_length = http_gen_header(r, self->data, CLIENT_DATA_FREE(self),
+            HTTP_FLAG_DATE | HTTP_FLAG_ACCEPT | HTTP_FLAG_CONTENT
+            | HTTP_FLAG_ENCODING | HTTP_FLAG_END);
+    if (self->data_length < 0 || (self->flags & CLIENT_FLAG_HEADERONLY)) {
+        client_close_file(self);
+        self->state = STATE_SEND_HEADER;
+        return 0;
+    }
+    r->part = -1;
+    if (client_next_part(self) != 0) {
+        self->data_length = -1;         /* see client_answer */
+    }
+    self->state = STATE_SEND_PARTS;
+    return 0;
+}
+
+/** Send the response header, followed by the file from the cache if it
+ * is in memory.
+ */
+static
+void client_send_response(struct client_t *self) {
+    self->state = STATE_SEND_HEADER;
+#if HAVE_FILECACHE == 1
+    if (self->file != NULL && self->file->content != NULL) {
+        self->state = STATE_SEND_MEMORY;
+    }
+#endif
+}
+
+#if HAVE_FILECACHE == 1
+/** Copy the pre-rendered 404 page, only its header for HEAD.
+ * @return -1 if it is left to client_process.
+ */
+static
+int client_send_notfound(struct client_t *self) {
+    const char *end;
+    int len;
+
+    self->response.status_code = HTTP_STATUS_NOTFOUND;
+    if (notfound_length_ == 0) {
+        notfound_length_ = http_gen_errorpage(&self->response, notfound_,
+                sizeof(notfound_));
+        end = (notfound_length_ > 0) ? strstr(notfound_, "\r\n\r\n") : NULL;
+        if (end == NULL) {
+            notfound_length_ = -1;
+        } else {
+            notfound_header_ = end + 4 - notfound_;
+        }
+    }
+    len = (self->flags & CLIENT_FLAG_HEADERONLY) ? notfound_header_
+            : notfound_length_;
+    if (len <= 0 || len > CLIENT_DATA_FREE(self)) {
+        return -1;
+    }
+    memcpy(self->data, notfound_, len);
+    self->data_length = len;
+    self->state = STATE_SEND_HEADER;
+    return 0;
+}
+#endif
+
+/** Generate the header of a 200 response. The fields which only depend
+ * on the file are rendered by filecache_put for a cached file.
+ */
+static
+int client_gen_header(struct client_t *self) {
+#if HAVE_FILECACHE == 1
+    struct filecache_t *f = self->file;
+
+    /* the fields of a sibling are rendered with its own type */
+    if (f != NULL && self->response.content_encoding == NULL) {
+        if (f->header_length > 0) {
+            return http_gen_header_template(&self->response, self->data,
+                    CLIENT_DATA_FREE(self), HTTP_FLAG_DATE | HTTP_FLAG_ENCODING
+                    | HTTP_FLAG_END, f->header, f->header_length);
+        }
+    }
+#endif
+    return http_gen_header(&self->response, self->data,
+            CLIENT_DATA_FREE(self), HTTP_FLAG_DATE | HTTP_FLAG_ACCEPT
+            | HTTP_FLAG_CONTENT | HTTP_FLAG_ENCODING | HTTP_FLAG_END);
+}
+
+/** Answer with the opened file (path), opened is the result of
+ * client_open_file. Response header is generated if ok.
+ */
+static
+int client_respond_file(struct client_t *self, const char *path, int opened) {
+    int len;
+
+    if (opened != 0) {
+#if HAVE_FILECACHE == 1
+        if (self->response.status_code == HTTP_STATUS_NOTFOUND) {
+            filecache_add_notfound(self->request.url);
+        }
+#endif
+        return -1;
+    }
+#if HAVE_PRECOMPRESSED == 1 || HAVE_COMPRESS == 1
+    client_select_encoding(self, path);
+#else
+    (void)path;
+#endif
+    /* generate header */
+    if (client_check_filemod(self) == 0) {
+        client_close_file(self);
+        self->response.status_code = HTTP_STATUS_NOTMODIFIED;
+        self->data_length = http_gen_header(&self->response, self->data,
+                CLIENT_DATA_FREE(self), HTTP_FLAG_DATE | HTTP_FLAG_ETAG
+                | HTTP_FLAG_ENCODING | HTTP_FLAG_END);
+        self->state = STATE_SEND_HEADER;
+        return 0;
+    }
+    len = client_check_ifrange(self) ? client_check_filerange(self) : 1;
+    if (len < 0) {
+        client_close_file(self);
+        return -1;
+    }
+    if (len == 0 && self->response.num_parts > 1) {
+        return client_respond_parts(self);
+    }
+    if (len == 0) {
+        self->response.status_code = HTTP_STATUS_PARTIALCONTENT;
+        self->data_length = http_gen_header(&self->response, self->data,
+                CLIENT_DATA_FREE(self), HTTP_FLAG_DATE | HTTP_FLAG_ACCEPT
+                | HTTP_FLAG_CONTENT | HTTP_FLAG_RANGE | HTTP_FLAG_ENCODING
+                | HTTP_FLAG_END);
+    } else {
+        self->response.status_code = HTTP_STATUS_OK;
+        self->data_length = client_gen_header(self);
+    }
+    if (self->flags & CLIENT_FLAG_HEADERONLY) {
+        client_close_file(self);
+    }
+    client_send_response(self);
+    return 0;
 }
 
 /**
  * Response header is generated if ok.
+ * @return 1 if the answer is left to client_opened.
  */
 static
 int client_respond(struct client_t *self) {
     int len;
-    char path[MAX_PATH_LENGTH];
+    char *path = self->path;
 
-    /* clean up */
-    http_decode_url(self->request.url);
-    http_sanitize_url(self->request.url);
+#if HAVE_OPENPOOL == 1
+    /* the path must stay while the file is opened by the pool */
+    if (self->job == NULL) {
+        self->job = opener_alloc(g_server.opener);
+    }
+    if (self->job != NULL) {
+        path = self->job->path;
+    }
+#endif
+    /* get path in fs, url is cleaned up */
+    len = http_get_realpath(&self->request, path);
+    if (len < 0) {
+        self->response.status_code = HTTP_STATUS_BADREQUEST;
+        return -1;
+    }
 
 #if HAVE_AUTH == 1
     if (auth_process(self) != 0) {
@@ -195,8 +816,12 @@ int client_respond(struct client_t *self) {
     }
 #endif
 
-    /* get path in fs */
-    len = http_get_realpath(self->request.url, path);
+#if HAVE_FILECACHE == 1
+    /* known missing url, no need to look for the file again */
+    if (filecache_notfound(self->request.url)) {
+        return client_send_notfound(self);
+    }
+#endif
 
 #if HAVE_CGI == 1
     if (cgi_hit(path, len) != 0) {
@@ -211,40 +836,26 @@ int client_respond(struct client_t *self) {
         self->flags |= CLIENT_FLAG_KEEPALIVE;
     }
     /* open file */
-    if (client_open_file(self, path) != 0) {
-        return -1;
-    }
-    /* generate header */
-    if (client_check_filemod(self) == 0) {
-        CLIENT_CLOSEFD_(self->local_rfd);
-        self->response.status_code = HTTP_STATUS_NOTMODIFIED;
-        self->data_length = http_gen_header(&self->response, self->data,
-                sizeof(self->data), HTTP_FLAG_END);
-        self->state = STATE_SEND_HEADER;
-        return 0;
-    }
-    len = client_check_filerange(self);
-    if (len < 0) {
-        CLIENT_CLOSEFD_(self->local_rfd);
-        return -1;
+    len = client_open_file(self, path);
+    if (len > 0) {
+        return 1;
     }
-    if (len == 0) {
-        self->response.status_code = HTTP_STATUS_PARTIALCONTENT;
-        self->data_length = http_gen_header(&self->response, self->data,
-                sizeof(self->data), HTTP_FLAG_ACCEPT | HTTP_FLAG_CONTENT
-                | HTTP_FLAG_RANGE | HTTP_FLAG_END);
+    return client_respond_file(self, path, len);
+}
+
+/** Generate the error page if the request failed.
+ */
+static
+void client_answer(struct client_t *self, int ret) {
+    if (ret != 0) {
+        self->data_length = http_gen_errorpage(&self->response, self->data,
+                CLIENT_DATA_FREE(self));
         self->state = STATE_SEND_HEADER;
-        return 0;
     }
-    if (self->flags & CLIENT_FLAG_HEADERONLY) {
-        CLIENT_CLOSEFD_(self->local_rfd);
+    if (self->data_length < 0) {
+        A_ERR("response too large for client %d", self->remote_fd);
+        self->state = STATE_NONE;
     }
-    self->response.status_code = HTTP_STATUS_OK;
-    self->data_length = http_gen_header(&self->response, self->data,
-            sizeof(self->data), HTTP_FLAG_ACCEPT | HTTP_FLAG_CONTENT
-            | HTTP_FLAG_END);
-    self->state = STATE_SEND_HEADER;
-    return 0;
 }
 
 /** Parse header and set state for the client
@@ -268,11 +879,26 @@ void client_process(struct client_t *self) {
         self->response.status_code = HTTP_STATUS_NOTIMPLEMENTED;
         ret = -1;
     }
-    if (ret != 0) {
-        self->data_length = http_gen_errorpage(&self->response, self->data,
-                sizeof(self->data));
-        self->state = STATE_SEND_HEADER;
+    if (ret > 0) {
+        return;                         /* STATE_OPENING */
     }
+    client_answer(self, ret);
 }
 
+#if HAVE_OPENPOOL == 1
+void client_opened(struct client_t *self) {
+    struct opener_job_t *job = self->job;
+    unsigned int variants = 0;
+    int ret;
+
+#if HAVE_PRECOMPRESSED == 1
+    variants = job->variants;           /* probed by the pool */
+#endif
+    ret = client_use_file(self, job->path, job->fd, &job->st, job->error,
+            variants);
+    job->fd = -1;                       /* owned by the client now */
+    client_answer(self, client_respond_file(self, job->path, ret));
+}
+#endif
+
 /* vim: set ts=4 sw=4 expandtab: */
@@ -8,8 +8,8 @@
 #include <aranea/aranea.h>
 
 /* save allocated clients to reduce number of malloc call */
-static struct client_t *poolclient_ = NULL;
-static int poolclient_len_ = 0;
+static A_TLS struct client_t *poolclient_ = NULL;
+static A_TLS int poolclient_len_ = 0;
 
 /** Get client from pool if possible
  */
@@ -43,6 +43,8 @@ void clientpool_cleanup() {
         c = c->next;
         free(tc);
     }
+    poolclient_ = NULL;
+    poolclient_len_ = 0;
 }
 
 /* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,473 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#if HAVE_THREAD == 1 || HAVE_OPENPOOL == 1
+# include <pthread.h>
+#endif
+
+#include <aranea/aranea.h>
+
+/* Entries are taken in order from the array, then reused from the free
+ * list. Unreferenced entries are kept in LRU order (most recent first) and
+ * the least recently used one is evicted when the array is full.
+ * Several clients share the same descriptor, reading with explicit offsets
+ * (pread and sendfile). Small files are read in memory instead.
+ * The cache is shared by the I/O threads of the process (and revalidated
+ * by the opener pool). An entry does not change once it is in the table (a
+ * modified file gets a new one), only the lists, references and counters
+ * do, under lock_.
+ */
+static struct filecache_t entries_[FILECACHE_SIZE];
+static int used_ = 0;
+static struct filecache_t *free_ = NULL;
+static struct filecache_t *idle_head_ = NULL;
+static struct filecache_t *idle_tail_ = NULL;
+static struct filecache_t *buckets_[FILECACHE_BUCKETS];
+static struct filecache_stats_t stats_;
+/* Direct mapped, a new url replaces the one in its slot */
+static struct filecache_notfound_t notfound_[FILECACHE_NOTFOUND];
+
+#if HAVE_THREAD == 1 || HAVE_OPENPOOL == 1
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+# define FILECACHE_LOCK_()      pthread_mutex_lock(&lock_)
+# define FILECACHE_UNLOCK_()    pthread_mutex_unlock(&lock_)
+#else
+# define FILECACHE_LOCK_()
+# define FILECACHE_UNLOCK_()
+#endif
+
+/** FNV-1a */
+static
+unsigned int filecache_hash(const char *path) {
+    unsigned int h = 2166136261u;
+
+    while (*path != '\0') {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+        ++path;
+    }
+    return h;
+}
+
+static
+void filecache_link_idle(struct filecache_t *self) {
+    self->prev = NULL;
+    self->next = idle_head_;
+    if (idle_head_ != NULL) {
+        idle_head_->prev = self;
+    } else {
+        idle_tail_ = self;
+    }
+    idle_head_ = self;
+}
+
+static
+void filecache_unlink_idle(struct filecache_t *self) {
+    if (self->prev != NULL) {
+        self->prev->next = self->next;
+    } else {
+        idle_head_ = self->next;
+    }
+    if (self->next != NULL) {
+        self->next->prev = self->prev;
+    } else {
+        idle_tail_ = self->prev;
+    }
+    self->next = self->prev = NULL;
+}
+
+static
+void filecache_free(struct filecache_t *self) {
+    if (self->content != NULL) {
+        free(self->content);
+        self->content = NULL;
+        stats_.memory -= self->size;
+    } else {
+        close(self->fd);
+    }
+    self->fd = -1;
+    self->next = free_;
+    free_ = self;
+}
+
+/** Remove the entry from the table. The file is closed now if no client
+ * is using it, or by the last one releasing it.
+ */
+static
+void filecache_drop(struct filecache_t *self) {
+    struct filecache_t **p;
+
+    for (p = &buckets_[self->hash % FILECACHE_BUCKETS]; *p != NULL;
+            p = &(*p)->hnext) {
+        if (*p == self) {
+            *p = self->hnext;
+            break;
+        }
+    }
+    self->hnext = NULL;
+    if (self->refs > 0) {
+        self->stale = 1;
+    } else {
+        filecache_unlink_idle(self);
+        filecache_free(self);
+    }
+}
+
+static
+struct filecache_t *filecache_find(const char *path, unsigned int h) {
+    struct filecache_t *e;
+
+    for (e = buckets_[h % FILECACHE_BUCKETS]; e != NULL; e = e->hnext) {
+        if (e->hash == h && strcmp(e->path, path) == 0) {
+            break;
+        }
+    }
+    return e;
+}
+
+static
+void filecache_ref(struct filecache_t *self) {
+    if (self->refs == 0) {
+        filecache_unlink_idle(self);
+    }
+    ++self->refs;
+}
+
+static
+void filecache_unref(struct filecache_t *self) {
+    if (--self->refs > 0) {
+        return;
+    }
+    if (self->stale) {
+        filecache_free(self);
+    } else {
+        filecache_link_idle(self);
+    }
+}
+
+/** Check if the file is still the one of the entry.
+ */
+static
+int filecache_same(const struct filecache_t *self, const struct stat *st,
+        unsigned int variants) {
+#if HAVE_PRECOMPRESSED == 1
+    if (variants != self->variants) {
+        return 0;
+    }
+#else
+    (void)variants;
+#endif
+    return st->st_ino == self->ino && st->st_dev == self->dev
+            && st->st_size == self->size && st->st_mtime == self->mtime;
+}
+
+/** Look at the file system again (no lock is held, the entry is
+ * referenced and its fields do not change).
+ * @return 0 if the file and its compressed siblings are unchanged.
+ */
+static
+int filecache_check(const struct filecache_t *self) {
+    struct stat st;
+    unsigned int variants = 0;
+
+    if (stat(self->path, &st) == -1) {
+        return -1;
+    }
+#if HAVE_PRECOMPRESSED == 1
+    variants = client_probe_variants(self->path, st.st_mtime);
+#endif
+    return filecache_same(self, &st, variants) ? 0 : -1;
+}
+
+void filecache_revalidate(struct filecache_t *self) {
+    int changed;
+
+    changed = filecache_check(self);
+    FILECACHE_LOCK_();
+#if HAVE_OPENPOOL == 1
+    self->checking = 0;
+#endif
+    if (changed && !self->stale) {
+        A_LOG("filecache: %s changed", self->path);
+        filecache_drop(self);
+    }
+    filecache_unref(self);
+    FILECACHE_UNLOCK_();
+}
+
+struct filecache_t *filecache_get(const char *path) {
+    struct filecache_t *e;
+    unsigned int h;
+    int check;
+
+    h = filecache_hash(path);
+    FILECACHE_LOCK_();
+    e = filecache_find(path, h);
+    if (e == NULL) {
+        ++stats_.misses;
+        FILECACHE_UNLOCK_();
+        return NULL;
+    }
+    filecache_ref(e);
+    ++stats_.hits;
+    /* the file may have been replaced or modified since it was opened,
+     * the other clients keep using the entry while it is checked */
+    check = g_curtime < e->checked || g_curtime - e->checked >= FILECACHE_TTL;
+    if (check) {
+        e->checked = g_curtime;
+#if HAVE_OPENPOOL == 1
+        if (e->checking) {
+            check = 0;              /* still queued */
+        } else {
+            e->checking = 1;
+            ++e->refs;              /* for the pool */
+        }
+#endif
+    }
+    FILECACHE_UNLOCK_();
+#if HAVE_OPENPOOL == 1
+    /* off the event loop, this client may still get the previous file */
+    if (check) {
+        if (opener_revalidate(e) == 0) {
+            return e;
+        }
+        FILECACHE_LOCK_();          /* the pool is not running */
+        e->checking = 0;
+        filecache_unref(e);
+        FILECACHE_UNLOCK_();
+    }
+#endif
+    if (check && filecache_check(e) != 0) {
+        A_LOG("filecache: %s changed", path);
+        FILECACHE_LOCK_();
+        if (!e->stale) {
+            filecache_drop(e);
+        }
+        filecache_unref(e);
+        --stats_.hits;
+        ++stats_.misses;
+        FILECACHE_UNLOCK_();
+        return NULL;
+    }
+    return e;
+}
+
+/** Read a small file, to be kept in memory.
+ * @return NULL on error.
+ */
+static
+char *filecache_read(int fd, off_t size) {
+    char *content;
+
+    content = malloc(size);
+    if (content == NULL) {
+        return NULL;
+    }
+    if (pread(fd, content, size, 0) != size) {
+        free(content);
+        return NULL;
+    }
+    return content;
+}
+
+/** Make room for size bytes of content, the least recently used contents
+ * are evicted to stay within the budget.
+ * @return -1 if there is not enough room.
+ */
+static
+int filecache_reserve(off_t size) {
+    struct filecache_t *e, *prev;
+
+    for (e = idle_tail_; e != NULL
+            && stats_.memory + size > FILECACHE_MEMORY; e = prev) {
+        prev = e->prev;
+        if (e->content != NULL) {
+            filecache_drop(e);
+        }
+    }
+    if (stats_.memory + size > FILECACHE_MEMORY) {
+        return -1;
+    }
+    stats_.memory += size;
+    return 0;
+}
+
+/** Take a free entry, the least recently used one is evicted if needed.
+ */
+static
+struct filecache_t *filecache_alloc() {
+    struct filecache_t *e;
+
+    if (free_ != NULL) {
+        e = free_;
+    } else if (used_ < FILECACHE_SIZE) {
+        return &entries_[used_++];
+    } else if (idle_tail_ != NULL) {
+        e = idle_tail_;
+        filecache_drop(e);          /* pushed to the free list */
+    } else {
+        return NULL;                /* every entry is in use */
+    }
+    free_ = e->next;
+    return e;
+}
+
+struct filecache_t *filecache_put(const char *path, int fd,
+        const struct stat *st, const char *type, unsigned int variants) {
+    struct filecache_t *e;
+    struct response_t response;
+    char header[FILECACHE_HEADER_LENGTH];
+    char *content = NULL;
+    int header_length;
+    unsigned int h;
+    size_t len;
+
+    len = strlen(path);
+    if (len >= sizeof(e->path)) {
+        return NULL;
+    }
+    /* fields of a 200 response and small content, before it is shared */
+    memset(&response, 0, sizeof(response));
+    response.content_type = type;
+    response.content_length = st->st_size;
+    response.last_mod = st->st_mtime;
+    response.etag_length = http_gen_etag(response.etag,
+            sizeof(response.etag), st);
+    header_length = http_gen_fields(&response, header, sizeof(header),
+            HTTP_FLAG_ACCEPT | HTTP_FLAG_CONTENT);
+    if (st->st_size > 0 && st->st_size <= FILECACHE_MAX_CONTENT) {
+        content = filecache_read(fd, st->st_size);
+    }
+
+    h = filecache_hash(path);
+    FILECACHE_LOCK_();
+    e = filecache_find(path, h);
+    if (e != NULL) {
+        if (filecache_same(e, st, variants)) {
+            /* opened by another client meanwhile */
+            filecache_ref(e);
+            FILECACHE_UNLOCK_();
+            free(content);
+            close(fd);
+            return e;
+        }
+        filecache_drop(e);
+    }
+    e = filecache_alloc();
+    if (e == NULL) {
+        FILECACHE_UNLOCK_();
+        free(content);
+        return NULL;
+    }
+    memcpy(e->path, path, len + 1);
+    e->hash = h;
+    e->fd = fd;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->ino = st->st_ino;
+    e->dev = st->st_dev;
+    e->type = type;
+    memcpy(e->etag, response.etag, response.etag_length);
+    e->etag_length = response.etag_length;
+    if (header_length > 0) {
+        memcpy(e->header, header, header_length);
+    }
+    e->header_length = header_length;
+#if HAVE_PRECOMPRESSED == 1
+    e->variants = variants;
+#endif
+#if HAVE_OPENPOOL == 1
+    e->checking = 0;
+#endif
+    e->checked = g_curtime;
+    e->refs = 1;
+    e->stale = 0;
+    e->next = e->prev = NULL;
+    e->content = NULL;
+    if (content != NULL && filecache_reserve(e->size) == 0) {
+        e->content = content;
+        e->fd = -1;
+        content = NULL;
+    }
+    e->hnext = buckets_[h % FILECACHE_BUCKETS];
+    buckets_[h % FILECACHE_BUCKETS] = e;
+    FILECACHE_UNLOCK_();
+    if (content == NULL && e->fd == -1) {
+        close(fd);                  /* read in memory */
+    }
+    free(content);
+    return e;
+}
+
+void filecache_release(struct filecache_t *self) {
+    FILECACHE_LOCK_();
+    filecache_unref(self);
+    FILECACHE_UNLOCK_();
+}
+
+int filecache_notfound(const char *url) {
+    struct filecache_notfound_t *n;
+    unsigned int h;
+    int found;
+
+    h = filecache_hash(url);
+    n = &notfound_[h % FILECACHE_NOTFOUND];
+    FILECACHE_LOCK_();
+    found = n->expires > g_curtime && n->hash == h && strcmp(n->url, url) == 0;
+    FILECACHE_UNLOCK_();
+    return found;
+}
+
+void filecache_add_notfound(const char *url) {
+    struct filecache_notfound_t *n;
+    unsigned int h;
+    size_t len;
+
+    len = strlen(url);
+    if (len >= sizeof(n->url)) {
+        return;
+    }
+    h = filecache_hash(url);
+    n = &notfound_[h % FILECACHE_NOTFOUND];
+    FILECACHE_LOCK_();
+    memcpy(n->url, url, len + 1);
+    n->hash = h;
+    n->expires = g_curtime + FILECACHE_NOTFOUND_TTL;
+    FILECACHE_UNLOCK_();
+}
+
+void filecache_stats(struct filecache_stats_t *stats) {
+    FILECACHE_LOCK_();
+    *stats = stats_;
+    FILECACHE_UNLOCK_();
+}
+
+void filecache_cleanup() {
+    int i;
+
+    for (i = 0; i < used_; ++i) {
+        if (entries_[i].content != NULL) {
+            free(entries_[i].content);
+            entries_[i].content = NULL;
+        } else if (entries_[i].fd != -1) {
+            close(entries_[i].fd);
+        }
+        entries_[i].fd = -1;
+    }
+    used_ = 0;
+    free_ = NULL;
+    idle_head_ = idle_tail_ = NULL;
+    memset(buckets_, 0, sizeof(buckets_));
+    memset(&stats_, 0, sizeof(stats_));
+    memset(notfound_, 0, sizeof(notfound_));
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -7,6 +7,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <immintrin.h>
+# define HTTP_AVX2_             1   /* used if the CPU supports it */
+#endif
 
 #include <aranea/aranea.h>
 
@@ -22,17 +29,119 @@
         }                                                           \
     } while (0)
 
+/** Status line and Server header, rendered at compile time */
+#define HTTP_STATUS_(code, msg)                                     \
+    { code, msg, HTTP_VERSION " " #code " " msg "\r\n"              \
+      "Server: " SERVER_ID "\r\n",                                  \
+      sizeof(HTTP_VERSION " " #code " " msg "\r\n"                  \
+      "Server: " SERVER_ID "\r\n") - 1 }
+
+/** Append a string if it fits (leaving room for a terminating NULL as
+ * snprintf does).
+ */
+#define HTTP_PUT_STRING_(str, n)                                    \
+    do {                                                            \
+        if ((n) >= sz) {                                            \
+            return -1;                                              \
+        }                                                           \
+        memcpy(data + len, str, n);                                 \
+        sz -= (n);                                                  \
+        len += (n);                                                 \
+    } while (0)
+
+#define HTTP_PUT_CONST_(str)    HTTP_PUT_STRING_(str, (int)sizeof(str) - 1)
+
+#define HTTP_PUT_NUMBER_(val)                                       \
+    do {                                                            \
+        i = http_put_number(data + len, sz, val);                   \
+        if (i < 0) {                                                \
+            return -1;                                              \
+        }                                                           \
+        sz -= i;                                                    \
+        len += i;                                                   \
+    } while (0)
+
+struct http_status_t {
+    int code;
+    const char *message;
+    const char *line;
+    int length;
+};
+
+static
+const struct http_status_t HTTP_STATUS[] = {
+        HTTP_STATUS_(200, "OK"),
+        HTTP_STATUS_(206, "Partial Content"),
+        HTTP_STATUS_(301, "Moved Permanently"),
+        HTTP_STATUS_(302, "Moved Temporarily"),
+        HTTP_STATUS_(303, "See Other"),
+        HTTP_STATUS_(304, "Not Modified"),
+        HTTP_STATUS_(400, "Bad Request"),
+        HTTP_STATUS_(401, "Authorization Required"),
+        HTTP_STATUS_(403, "Forbidden"),
+        HTTP_STATUS_(404, "Not Found"),
+        HTTP_STATUS_(413, "Request Entity Too Large"),
+        HTTP_STATUS_(416, "Requested Range Not Satisfiable"),
+        HTTP_STATUS_(500, "Server Error"),
+        HTTP_STATUS_(501, "Not Implemented"),
+        HTTP_STATUS_(503, "Service Unavailable"),
+};
+
+/** Date header, rendered again when g_curtime changes */
+static A_TLS char date_[64];
+static A_TLS int date_length_ = 0;
+static A_TLS time_t date_time_;
+/** Last-Modified of the last file, usually the same as the next one */
+static A_TLS char lastmod_[64];
+static A_TLS int lastmod_length_ = 0;
+static A_TLS time_t lastmod_time_;
+/** Last date parsed (If-Modified-Since, If-Range) */
+static A_TLS char parsed_[MAX_DATE_LENGTH];
+static A_TLS time_t parsed_time_ = -1;
+
+/** Perfect hash of the lowercase header names, no two of them share a
+ * slot. http_check_headers() verifies the slots (bench-parser fails to
+ * build otherwise), change the formula if a new header collides.
+ */
+#define HTTP_HEADER_SLOTS_      32
+#define HTTP_HEADER_HASH_(key, len)                                 \
+    (((len) * 8 + ((key)[0] | 0x20) + ((key)[(len) - 1] | 0x20))    \
+     & (HTTP_HEADER_SLOTS_ - 1))
+#define HTTP_HEADER_(name, id)  { name, sizeof(name) - 1, id }
+
+struct http_header_t {
+    const char *name;
+    int length;
+    int id;
+};
+
+/** Content codings of Accept-Encoding, "*" is any of them */
 static
-const char * const HTTP_REQUEST_HEADERS[NUM_REQUEST_HEADER] = {
+const struct http_header_t HTTP_ENCODINGS[] = {
+        HTTP_HEADER_("br", ENCODING_BR),
+        HTTP_HEADER_("gzip", ENCODING_GZIP),
+        HTTP_HEADER_("x-gzip", ENCODING_GZIP),
+        HTTP_HEADER_("zstd", ENCODING_ZSTD),
+        HTTP_HEADER_("*", ENCODING_BR | ENCODING_GZIP | ENCODING_ZSTD),
+};
+
+static
+const struct http_header_t HTTP_REQUEST_HEADERS[HTTP_HEADER_SLOTS_] = {
+        [0]  = HTTP_HEADER_("accept-encoding", HEADER_ACCEPTENCODING),
+        [1]  = HTTP_HEADER_("connection", HEADER_CONNECTION),
+        [8]  = HTTP_HEADER_("content-type", HEADER_CONTENTTYPE),
+        [9]  = HTTP_HEADER_("expect", HEADER_EXPECT),
+        [14] = HTTP_HEADER_("if-range", HEADER_IFRANGE),
+        [16] = HTTP_HEADER_("content-range", HEADER_CONTENTRANGE),
+        [22] = HTTP_HEADER_("if-modified-since", HEADER_IFMODIFIEDSINCE),
 #if HAVE_AUTH == 1
-        "Authorization",
+        [23] = HTTP_HEADER_("authorization", HEADER_AUTHORIZATION),
 #endif
-        "Connection",
-        "Content-Length",
-        "Content-Range",
-        "Content-Type",
-        "Cookie",
-        "If-Modified-Since",
+        [24] = HTTP_HEADER_("cookie", HEADER_COOKIE),
+        [25] = HTTP_HEADER_("if-none-match", HEADER_IFNONEMATCH),
+        [27] = HTTP_HEADER_("content-length", HEADER_CONTENTLENGTH),
+        [28] = HTTP_HEADER_("host", HEADER_HOST),
+        [31] = HTTP_HEADER_("range", HEADER_RANGE),
 };
 
 static
@@ -46,50 +155,95 @@ int hex_to_int(const char c) {
     if (c >= 'a' && c <= 'f') {
         return c - 'a' + 10;
     }
-    return 0;
+    return -1;
+}
+
+/** Parse a byte position, up to 18 digits so that it cannot overflow.
+ * @return -1 if there is none.
+ */
+static
+off_t http_parse_offset(char **val) {
+    char *p = *val;
+    off_t n = 0;
+
+    while (*p >= '0' && *p <= '9') {
+        n = n * 10 + (*p - '0');
+        ++p;
+    }
+    if (p == *val || p - *val > 18) {
+        return -1;
+    }
+    *val = p;
+    return n;
 }
 
 /**
- * Only get the first range if a list is given
+ * Parse the list of ranges ("bytes=0-99, 200-, -50"). The header is
+ * ignored (whole file) if it is invalid or has more than MAX_RANGES.
  */
 static
 void http_parse_range(struct request_t *self, char *val) {
-    char *delim;
+    struct range_t *r;
 
     if (strncmp(val, "bytes=", 6) != 0) {
         A_ERR("ranges are not in bytes: %s", val);
         return;
     }
     val += 6;
-    delim = strchr(val, '-');
-    if (delim == NULL) {
-        A_ERR("no hyphen: %s", val);
-        return;
-    }
-    if (delim == val) {         /* range_from is not given */
-        self->range_from = NULL;
-    } else {
-        *delim = '\0';
-        self->range_from = val;
-    }
-    self->range_to = delim + 1;
-    delim = strchr(self->range_to, ',');
-    if (delim != NULL) {
-        *delim = '\0';          /* only the first range in the list */
+    self->num_ranges = 0;
+    while (*val != '\0') {
+        if (*val == ' ' || *val == '\t' || *val == ',') {
+            ++val;
+            continue;
+        }
+        if (self->num_ranges >= MAX_RANGES) {
+            A_ERR("too many ranges: %s", val);
+            goto err;
+        }
+        r = &self->ranges[self->num_ranges];
+        r->from = -1;
+        r->to = -1;
+        if (*val != '-' && (r->from = http_parse_offset(&val)) < 0) {
+            goto err;
+        }
+        if (*val != '-') {
+            goto err;
+        }
+        ++val;
+        if (*val >= '0' && *val <= '9') {
+            r->to = http_parse_offset(&val);
+            if (r->to < 0 || (r->from >= 0 && r->to < r->from)) {
+                goto err;
+            }
+        } else if (r->from < 0) {
+            goto err;                   /* "-" */
+        }
+        if (*val != '\0' && *val != ',' && *val != ' ' && *val != '\t') {
+            goto err;
+        }
+        ++self->num_ranges;
     }
+    return;
+err:
+    A_ERR("invalid range: %s", val);
+    self->num_ranges = 0;
 }
 
 static
 void http_save_header(struct request_t *self, char *key, char *val) {
-    int i;
+    const struct http_header_t *h;
+    int len;
 
-    for (i = 0; i < NUM_REQUEST_HEADER; ++i) {
-        if (strcasecmp(key, HTTP_REQUEST_HEADERS[i]) == 0) {
-            self->header[i] = val;
-            break;
-        }
+    len = strlen(key);
+    if (len == 0) {
+        return;
+    }
+    h = &HTTP_REQUEST_HEADERS[HTTP_HEADER_HASH_(key, len)];
+    if (h->length != len || strncasecmp(key, h->name, len) != 0) {
+        return;                 /* not supported */
     }
-    if (i == HEADER_CONTENTRANGE) {
+    self->header[h->id] = val;
+    if (h->id == HEADER_RANGE) {
         http_parse_range(self, val);
     }
 }
@@ -224,34 +378,210 @@ int http_parse(struct request_t *self, char *data, int len) {
     return 0;
 }
 
+unsigned int http_parse_encoding(const char *val) {
+    const char *p;
+    unsigned int i, mask;
+    int len;
+
+    mask = 0;
+    while (val != NULL && *val != '\0') {
+        val += strspn(val, " \t,");
+        len = strcspn(val, " \t,;");
+        /* "gzip;q=0" is not acceptable */
+        p = val + len;
+        p += strspn(p, " \t");
+        if (*p == ';') {
+            ++p;
+            p += strspn(p, " \t");
+            if ((*p == 'q' || *p == 'Q') && p[1] == '='
+                    && strtod(p + 2, NULL) <= 0) {
+                len = 0;
+            }
+        }
+        for (i = 0; len > 0 && i < A_SIZEOF(HTTP_ENCODINGS); ++i) {
+            if (HTTP_ENCODINGS[i].length == len
+                    && strncasecmp(val, HTTP_ENCODINGS[i].name, len) == 0) {
+                mask |= HTTP_ENCODINGS[i].id;
+                break;
+            }
+        }
+        val = strchr(val, ',');
+    }
+    return mask;
+}
+
+int http_gen_etag(char *data, int sz, const struct stat *st) {
+    int len;
+
+    len = snprintf(data, sz, "\"%llx-%llx-%llx\"",
+            (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+            (unsigned long long)st->st_mtime);
+    if (len < 0 || len >= sz) {
+        return 0;
+    }
+    return len;
+}
+
+int http_match_etag(const char *list, const char *etag, int len, int strong) {
+    int weak;
+
+    if (len <= 0) {
+        return 0;
+    }
+    while (list != NULL) {
+        list += strspn(list, " \t,");
+        if (*list == '*' && !strong) {
+            return 1;
+        }
+        weak = (list[0] == 'W' && list[1] == '/');
+        if (weak) {
+            list += 2;
+        }
+        if ((!weak || !strong) && strncmp(list, etag, len) == 0
+                && strchr(" \t,", list[len]) != NULL) {
+            return 1;                   /* including the final NULL */
+        }
+        list = strchr(list, ',');
+    }
+    return 0;
+}
+
+time_t http_parse_date(const char *val) {
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *p;
+    char mon[4];
+    struct tm tm;
+    size_t len;
+
+    len = strlen(val);
+    if (len < sizeof(parsed_) && strcmp(val, parsed_) == 0) {
+        return parsed_time_;
+    }
+    /* Sun, 06 Nov 1994 08:49:37 GMT */
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(val, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, mon,
+            &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return -1;
+    }
+    p = strstr(MONTHS, mon);
+    if (p == NULL || strlen(mon) != 3 || (p - MONTHS) % 3 != 0) {
+        return -1;
+    }
+    tm.tm_mon = (p - MONTHS) / 3;
+    tm.tm_year -= 1900;
+    if (len < sizeof(parsed_)) {
+        memcpy(parsed_, val, len + 1);
+        parsed_time_ = timegm(&tm);
+        return parsed_time_;
+    }
+    return timegm(&tm);
+}
+
+static
+const struct http_status_t *http_find_status(int code) {
+    unsigned int i;
+
+    for (i = 0; i < A_SIZEOF(HTTP_STATUS); ++i) {
+        if (HTTP_STATUS[i].code == code) {
+            return &HTTP_STATUS[i];
+        }
+    }
+    return NULL;
+}
+
+/** Write a non-negative number in decimal.
+ * @return length, -1 if it does not fit.
+ */
+static
+int http_put_number(char *data, int sz, off_t val) {
+    char buf[24];
+    int i;
+
+    i = sizeof(buf);
+    do {
+        buf[--i] = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0 && i > 0);
+    if ((int)sizeof(buf) - i >= sz) {
+        return -1;
+    }
+    memcpy(data, buf + i, sizeof(buf) - i);
+    return sizeof(buf) - i;
+}
+
+/** Render a date header line in buf, only if the time has changed.
+ */
+static
+int http_render_date(char *buf, int sz, int *length, time_t *last,
+        const char *fmt, time_t t) {
+    struct tm tm;
+
+    if (*length == 0 || *last != t) {
+        *length = strftime(buf, sz, fmt, gmtime_r(&t, &tm));
+        *last = t;
+    }
+    return *length;
+}
+
 static
 int http_put_headerdate(struct response_t *self, char *data, int sz) {
-    struct tm *tm;
+    int len, n;
     (void)self;
 
-    tm = gmtime(&g_curtime);
-    return strftime(data, sz, "Date: " DATE_FORMAT "\r\n", tm);
+    len = 0;
+    n = http_render_date(date_, sizeof(date_), &date_length_, &date_time_,
+            "Date: " DATE_FORMAT "\r\n", g_curtime);
+    HTTP_PUT_STRING_(date_, n);
+    return len;
 }
 
 /** Insert version, server and date
  */
 static
 int http_put_headerstatus(struct response_t *self, char *data, int sz) {
-    return snprintf(data, sz,
-            HTTP_VERSION " %d %s\r\n"
-            "Server: " SERVER_ID "\r\n",
-            self->status_code, http_string_status(self->status_code));
+    const struct http_status_t *status;
+    int len;
+
+    status = http_find_status(self->status_code);
+    if (status == NULL) {
+        return snprintf(data, sz,
+                HTTP_VERSION " %d %s\r\n"
+                "Server: " SERVER_ID "\r\n",
+                self->status_code, http_string_status(self->status_code));
+    }
+    len = 0;
+    HTTP_PUT_STRING_(status->line, status->length);
+    return len;
 }
 
 /** Insert Accept-...
  */
 static
 int http_put_headeraccept(struct response_t *self, char *data, int sz) {
+    int len;
     (void)self;
-    return snprintf(data, sz, "Accept-Ranges: bytes\r\n");
+
+    len = 0;
+    HTTP_PUT_CONST_("Accept-Ranges: bytes\r\n");
+    return len;
 }
 
-/** Insert Content-Type, Content-Length and Last-Modified.
+/** Insert ETag.
+ */
+static
+int http_put_headeretag(struct response_t *self, char *data, int sz) {
+    int len;
+
+    len = 0;
+    if (self->etag_length > 0) {
+        HTTP_PUT_CONST_("ETag: ");
+        HTTP_PUT_STRING_(self->etag, self->etag_length);
+        HTTP_PUT_CONST_("\r\n");
+    }
+    return len;
+}
+
+/** Insert Content-Type, Content-Length, Last-Modified and ETag.
  */
 static
 int http_put_headercontent(struct response_t *self, char *data, int sz) {
@@ -259,31 +589,48 @@ int http_put_headercontent(struct response_t *self, char *data, int sz) {
 
     len = 0;
     if (self->content_length >= 0) {
-        i = snprintf(data, sz, "Content-Length: %ld\r\n",
-                self->content_length);
-        if (i < 0 || i >= sz) {
-            return -1;
-        }
-        sz -= i;
-        len += i;
+        HTTP_PUT_CONST_("Content-Length: ");
+        HTTP_PUT_NUMBER_(self->content_length);
+        HTTP_PUT_CONST_("\r\n");
     }
-    if (self->content_type != NULL) {
-        i = snprintf(data + len, sz, "Content-Type: %s\r\n",
-                self->content_type);
-        if (i < 0 || i >= sz) {
-            return -1;
-        }
-        sz -= i;
-        len += i;
+    if (self->num_parts > 1) {
+        HTTP_PUT_CONST_("Content-Type: multipart/byteranges; boundary=");
+        HTTP_PUT_STRING_(self->boundary, (int)strlen(self->boundary));
+        HTTP_PUT_CONST_("\r\n");
+    } else if (self->content_type != NULL) {
+        HTTP_PUT_CONST_("Content-Type: ");
+        HTTP_PUT_STRING_(self->content_type, (int)strlen(self->content_type));
+        HTTP_PUT_CONST_("\r\n");
     }
     if (self->last_mod >= 0) {
-        i = strftime(data + len, sz, "Last-Modified: " DATE_FORMAT "\r\n",
-                gmtime(&self->last_mod));
-        if (i < 0 || i >= sz) {
-            return -1;
-        }
-        sz -= i;
-        len += i;
+        i = http_render_date(lastmod_, sizeof(lastmod_), &lastmod_length_,
+                &lastmod_time_, "Last-Modified: " DATE_FORMAT "\r\n",
+                self->last_mod);
+        HTTP_PUT_STRING_(lastmod_, i);
+    }
+    i = http_put_headeretag(self, data + len, sz);
+    if (i < 0) {
+        return -1;
+    }
+    len += i;
+    return len;
+}
+
+/** Insert Content-Encoding and Vary.
+ */
+static
+int http_put_headerencoding(struct response_t *self, char *data, int sz) {
+    int len;
+
+    len = 0;
+    if (self->content_encoding != NULL) {
+        HTTP_PUT_CONST_("Content-Encoding: ");
+        HTTP_PUT_STRING_(self->content_encoding,
+                (int)strlen(self->content_encoding));
+        HTTP_PUT_CONST_("\r\n");
+    }
+    if (self->vary) {
+        HTTP_PUT_CONST_("Vary: Accept-Encoding\r\n");
     }
     return len;
 }
@@ -292,17 +639,56 @@ int http_put_headercontent(struct response_t *self, char *data, int sz) {
  */
 static
 int http_put_headerrange(struct response_t *self, char *data, int sz) {
-    off_t to;
+    int len, i;
+
+    len = 0;
+    HTTP_PUT_CONST_("Content-Range: bytes ");
+    HTTP_PUT_NUMBER_(self->content_from);
+    HTTP_PUT_CONST_("-");
+    HTTP_PUT_NUMBER_(self->content_from + self->content_length - 1);
+    HTTP_PUT_CONST_("/");
+    HTTP_PUT_NUMBER_(self->total_length);
+    HTTP_PUT_CONST_("\r\n");
+    return len;
+}
+
+int http_gen_fields(struct response_t *self, char *data, int sz,
+        const unsigned int flags) {
+    int len, i;
+
+    len = 0;
+    HTTP_PUT_HEADER_(HTTP_FLAG_DATE, http_put_headerdate, len, sz);
+    HTTP_PUT_HEADER_(HTTP_FLAG_ACCEPT, http_put_headeraccept, len, sz);
+    HTTP_PUT_HEADER_(HTTP_FLAG_CONTENT, http_put_headercontent, len, sz);
+    HTTP_PUT_HEADER_(HTTP_FLAG_ETAG, http_put_headeretag, len, sz);
+    HTTP_PUT_HEADER_(HTTP_FLAG_RANGE, http_put_headerrange, len, sz);
+    HTTP_PUT_HEADER_(HTTP_FLAG_ENCODING, http_put_headerencoding, len, sz);
 
-    to = self->content_from + self->content_length - 1;
-    return snprintf(data, sz, "Content-Range: bytes %ld-%ld/%ld\r\n",
-            self->content_from, to, self->total_length);
+    if (flags & HTTP_FLAG_END) {
+        HTTP_PUT_CONST_("\r\n");
+    }
+    return len;
 }
 
 int http_gen_header(struct response_t *self, char *data, int sz,
         const unsigned int flags) {
     int len, i;
 
+    len = http_put_headerstatus(self, data, sz);
+    if (len < 0 || len >= sz) {
+        return -1;
+    }
+    i = http_gen_fields(self, data + len, sz - len, flags);
+    if (i < 0) {
+        return -1;
+    }
+    return len + i;
+}
+
+int http_gen_header_template(struct response_t *self, char *data, int sz,
+        const unsigned int flags, const char *fields, int length) {
+    int len, i;
+
     len = http_put_headerstatus(self, data, sz);
     if (len < 0 || len >= sz) {
         return -1;
@@ -310,20 +696,43 @@ int http_gen_header(struct response_t *self, char *data, int sz,
     sz -= len;
 
     HTTP_PUT_HEADER_(HTTP_FLAG_DATE, http_put_headerdate, len, sz);
-    HTTP_PUT_HEADER_(HTTP_FLAG_ACCEPT, http_put_headeraccept, len, sz);
-    HTTP_PUT_HEADER_(HTTP_FLAG_CONTENT, http_put_headercontent, len, sz);
-    HTTP_PUT_HEADER_(HTTP_FLAG_RANGE, http_put_headerrange, len, sz);
-
+    HTTP_PUT_STRING_(fields, length);
+    HTTP_PUT_HEADER_(HTTP_FLAG_ENCODING, http_put_headerencoding, len, sz);
     if (flags & HTTP_FLAG_END) {
-        i = snprintf(data + len, sz, "\r\n");
-        if (i < 0 || i >= sz) {
-            return -1;
-        }
-        len += i;
+        HTTP_PUT_CONST_("\r\n");
     }
     return len;
 }
 
+int http_gen_part(struct response_t *self, char *data, int sz) {
+    int len, i;
+
+    len = 0;
+    if (self->part > 0) {
+        HTTP_PUT_CONST_("\r\n");
+    }
+    HTTP_PUT_CONST_("--");
+    HTTP_PUT_STRING_(self->boundary, (int)strlen(self->boundary));
+    if (self->part >= self->num_parts) {
+        HTTP_PUT_CONST_("--\r\n");
+        return len;
+    }
+    HTTP_PUT_CONST_("\r\n");
+    if (self->content_type != NULL) {
+        HTTP_PUT_CONST_("Content-Type: ");
+        HTTP_PUT_STRING_(self->content_type, (int)strlen(self->content_type));
+        HTTP_PUT_CONST_("\r\n");
+    }
+    i = http_put_headerrange(self, data + len, sz);
+    if (i < 0) {
+        return -1;
+    }
+    sz -= i;
+    len += i;
+    HTTP_PUT_CONST_("\r\n");
+    return len;
+}
+
 int http_gen_errorpage(struct response_t *self, char *data, int sz) {
     int len, i;
 
@@ -344,13 +753,7 @@ int http_gen_errorpage(struct response_t *self, char *data, int sz) {
         len += i;
     }
 #endif
-    i = snprintf(data + len, sz,
-            "Content-Type: text/html\r\n\r\n");
-    if (i < 0 || i >= sz) {
-        return -1;
-    }
-    sz -= i;
-    len += i;
+    HTTP_PUT_CONST_("Content-Type: text/html\r\n\r\n");
     i = snprintf(data + len, sz,
             "<html><head><title>%d</title></head><body>"
             "<h1>%d %s</h1><hr />" SERVER_ID
@@ -363,160 +766,261 @@ int http_gen_errorpage(struct response_t *self, char *data, int sz) {
     return len + i;
 }
 
-void http_decode_url(char *url) {
-    char *out;
-    char c;
-
-    out = url;
-    while ('\0' != (c = *url)) {
-        if (c == '%' && *(url + 1) != '\0' && *(url + 2) != '\0') {
-            *out = (char)(hex_to_int(*(url + 1)) * 16 + hex_to_int(*(url + 2)));
-            ++out;
-            url += 2;
-        } else {
-            *out = c;
-            ++out;
-            ++url;
+/** End the segment of path which starts at seg (after a '/'): "." is
+ * removed, ".." is removed with the previous segment (but not above
+ * start), other names starting with '.' (hidden files) are refused.
+ * @return the new end of path, NULL if the segment is refused.
+ */
+static
+char *http_end_segment(const char *start, char *seg, char *path) {
+    if (path == seg || *seg != '.') {
+        return path;
+    }
+    if (path - seg == 1) {
+        return seg;                     /* "." */
+    }
+    if (path - seg == 2 && seg[1] == '.') {
+        if (seg - 1 > start) {          /* ".." */
+            for (--seg; seg > start && *(seg - 1) != '/'; --seg);
         }
+        return seg;
     }
-    *out = '\0';
+    return NULL;
 }
 
-/** Make url safe
- * Do not allow file start with '.'.
- * Replace "/\.+" to "/"
+/** Append the url to path, percent-decoded and without relative parts:
+ * dot segments are removed as in RFC 3986 5.2.4 (after decoding, so
+ * "%2e%2e" is removed too) and empty ones are dropped. Files starting
+ * with '.' are not served. Runs without '%' or '/' are copied as is.
+ * @return the end of path, NULL if the url is invalid or too long.
  */
-void http_sanitize_url(char *url) {
-    char *out;
+static
+char *http_clean_url(const char *url, char *path, const char *end) {
+    const char *start = path;
+    char *seg = path;                   /* current segment */
+    size_t n;
+    int hi, lo;
     char c;
 
-    out = url;
     for (;;) {
+        n = strcspn(url, "%/");
+        if (path + n >= end) {
+            return NULL;
+        }
+        memcpy(path, url, n);
+        path += n;
+        url += n;
         c = *url;
-        switch (c) {
-        case '/':
-            if (out != url) {
-                *out = c;
-            }
-            ++out;
-            ++url;
-            while ('.' == *url) {
-                ++url;
-            }
+        if (c == '\0') {
             break;
-        case '\0':
-            if (out != url) {
-                *out = c;
+        }
+        if (c == '%') {
+            hi = hex_to_int(*(url + 1));
+            lo = (hi < 0) ? -1 : hex_to_int(*(url + 2));
+            if (lo < 0) {
+                A_ERR("invalid encoding in url %s", url);
+                return NULL;
             }
-            return;
-        default:
-            if (out != url) {
-                *out = c;
+            c = (char)(hi * 16 + lo);
+            if (c == '\0') {
+                A_ERR("encoded NUL in url %s", url);
+                return NULL;
             }
-            ++out;
+            url += 3;
+        } else {
             ++url;
-            break;
+        }
+        if (c == '/') {
+            path = http_end_segment(start, seg, path);
+            if (path == NULL) {
+                return NULL;
+            }
+            if (path > start && *(path - 1) == '/') {
+                seg = path;             /* removed or empty */
+                continue;
+            }
+        }
+        if (path + 1 >= end) {
+            return NULL;
+        }
+        *path = c;
+        ++path;
+        if (c == '/') {
+            seg = path;
         }
     }
+    path = http_end_segment(start, seg, path);
+    if (path == NULL) {
+        return NULL;
+    }
+    *path = '\0';
+    return path;
 }
 
-int http_get_realpath(const char *url, char *path) {
+int http_get_realpath(struct request_t *self, char *path) {
+    char *url, *end;
     int len;
 
-    /* snprintf is slower but safer than strcat/strncpy */
-#if HAVE_CHROOT == 1                    /* already chroot */
-    len = snprintf(path, MAX_PATH_LENGTH, "%s", url);
-#else
-    len = snprintf(path, MAX_PATH_LENGTH, "%s%s", g_config.root, url);
-#endif
+    len = g_config.root_length;         /* 0 if already chroot */
     if (len >= MAX_PATH_LENGTH) {
-        len = MAX_PATH_LENGTH - 1;
+        return -1;
     }
+    memcpy(path, g_config.root, len);
+    url = path + len;
+    end = http_clean_url(self->url, url, path + MAX_PATH_LENGTH);
+    if (end == NULL) {
+        return -1;
+    }
+    self->url = url;
+    len = end - path;
     /* append default index file */
-    if (path[len - 1] == '/') {
+    if (len > 0 && path[len - 1] == '/') {
         /* url/index.html */
-        len += snprintf(path + len, MAX_PATH_LENGTH - len, "%s", WWW_INDEX);
-        if (len >= MAX_PATH_LENGTH) {
-            len = MAX_PATH_LENGTH - 1;
+        if (len + sizeof(WWW_INDEX) > MAX_PATH_LENGTH) {
+            return -1;
         }
+        memcpy(path + len, WWW_INDEX, sizeof(WWW_INDEX));
+        len += sizeof(WWW_INDEX) - 1;
     }
     return len;
 }
 
+#if defined(__SSE2__)
+/** Look for LF followed by LF or CR LF, 16 bytes at a time.
+ * @return position of the first byte not searched, or the negated header
+ *         length minus one if the termination is found.
+ */
+static
+int http_find_end_sse2(const char *data, int i, int len) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    __m128i v0, v1, v2;
+    unsigned int m;
+    int p;
+
+    for (; i + 18 <= len; i += 16) {
+        v0 = _mm_loadu_si128((const __m128i *)(data + i));
+        v1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        v2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+        m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v0, lf),
+                _mm_or_si128(_mm_cmpeq_epi8(v1, lf),
+                    _mm_and_si128(_mm_cmpeq_epi8(v1, cr),
+                        _mm_cmpeq_epi8(v2, lf)))));
+        for (; m != 0; m &= m - 1) {
+            p = i + __builtin_ctz(m);
+            if (data[p + 1] == '\n') {
+                return -(p + 2) - 1;
+            }
+            if (p > 0 && data[p - 1] == '\r') {
+                return -(p + 3) - 1;
+            }
+        }
+    }
+    return i;
+}
+#endif
+
+#if defined(HTTP_AVX2_)
+/** Same as http_find_end_sse2, 32 bytes at a time.
+ */
+static __attribute__((target("avx2")))
+int http_find_end_avx2(const char *data, int i, int len) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    __m256i v0, v1, v2;
+    unsigned int m;
+    int p;
+
+    for (; i + 34 <= len; i += 32) {
+        v0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        v1 = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+        v2 = _mm256_loadu_si256((const __m256i *)(data + i + 2));
+        m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v0, lf),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v1, lf),
+                    _mm256_and_si256(_mm256_cmpeq_epi8(v1, cr),
+                        _mm256_cmpeq_epi8(v2, lf)))));
+        for (; m != 0; m &= m - 1) {
+            p = i + __builtin_ctz(m);
+            if (data[p + 1] == '\n') {
+                return -(p + 2) - 1;
+            }
+            if (p > 0 && data[p - 1] == '\r') {
+                return -(p + 3) - 1;
+            }
+        }
+    }
+    return i;
+}
+#endif
+
 /** Find the length of request header by looking for the header termination
  * (\r\n\r\n or \n\n)
  */
-int http_find_headerlength(const char *data, int len) {
-    int sz = 0;
-    const char *crlf = data;
+int http_find_headerlength(const char *data, int len, int from) {
+    int sz;
+    const char *crlf;
 
-    for (;;) {
+    /* termination may start in the searched part */
+    sz = (from > 3) ? (from - 3) : 0;
+#if defined(HTTP_AVX2_)
+    if (__builtin_cpu_supports("avx2")) {
+        sz = http_find_end_avx2(data, sz, len);
+        if (sz < 0) {
+            return -sz - 1;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    sz = http_find_end_sse2(data, sz, len);
+    if (sz < 0) {
+        return -sz - 1;
+    }
+#endif
+    /* the rest is searched line by line */
+    crlf = data + sz;
+
+    while (sz < len) {
         crlf = memchr(crlf, '\n', len - sz);
         if (crlf == NULL) {
             break;
         }
         sz = crlf - data;
-        if (sz > 0 && sz <= (len - 3) && *(crlf - 1) == '\r'
+        if (sz > 0 && sz + 2 < len && *(crlf - 1) == '\r'
                 && *(crlf + 1) == '\r' && *(crlf + 2) == '\n') {
             /* \r\n\r\n */
             return sz + 3;
         }
-        if (sz <= (len - 1) && *(crlf + 1) == '\n') {
+        if (sz + 1 < len && *(crlf + 1) == '\n') {
             /* \n\n */
             return sz + 2;
         }
         /* continue */
         ++crlf;
         ++sz;
-        if (sz >= len) {
-            break;
-        }
     }
     return -1;
 }
 
-const char *http_string_status(int code) {
-    if (code < 300) {               /* 2xx */
-        switch (code) {
-        case HTTP_STATUS_OK:
-            return "OK";
-        case HTTP_STATUS_PARTIALCONTENT:
-            return "Partial Content";
-        }
-    } else if (code < 400) {        /* 3xx */
-        switch (code) {
-        case HTTP_STATUS_MOVEDPERMANENTLY:
-            return "Moved Permanently";
-        case 302:
-            return "Moved Temporarily ";
-        case 303:
-            return "See Other";
-        case HTTP_STATUS_NOTMODIFIED:
-            return "Not Modified";
-        }
-    } else if (code < 500) {        /* 4xx */
-        switch (code) {
-        case HTTP_STATUS_BADREQUEST:
-            return "Bad Request";
-        case HTTP_STATUS_AUTHORIZATIONREQUIRED:
-            return "Authorization Required";
-        case HTTP_STATUS_FORBIDDEN:
-            return "Forbidden";
-        case HTTP_STATUS_NOTFOUND:
-            return "Not Found";
-        case HTTP_STATUS_ENTITYTOOLARGE:
-            return "Request Entity Too Large";
-        case HTTP_STATUS_RANGENOTSATISFIABLE:
-            return "Requested Range Not Satisfiable";
-        }
-    } else {
-        switch (code) {             /* 5xx */
-        case HTTP_STATUS_SERVERERROR:
-            return "Server Error";
-        case HTTP_STATUS_NOTIMPLEMENTED:
-            return "Not Implemented";
+const char *http_check_headers() {
+    const struct http_header_t *h;
+    int i;
+
+    for (i = 0; i < HTTP_HEADER_SLOTS_; ++i) {
+        h = &HTTP_REQUEST_HEADERS[i];
+        if (h->name != NULL && HTTP_HEADER_HASH_(h->name, h->length) != i) {
+            return h->name;
         }
     }
+    return NULL;
+}
+
+const char *http_string_status(int code) {
+    const struct http_status_t *status;
+
+    status = http_find_status(code);
+    if (status != NULL) {
+        return status->message;
+    }
     A_ERR("unknown code %d", code);
     return "Unknown";
 }
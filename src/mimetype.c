@@ -9,51 +9,52 @@
 
 #include <aranea/aranea.h>
 
-/* Default mimetype mappings */
+/* Default mimetype mappings, and whether the content is worth compressing
+ * (text) or not (already compressed, binary) */
 static
 const struct mimetype_t DEFAULT_MIME_TYPES[] = {
-    {   "avi",      "video/x-msvideo" },
-    {   "bin",      "application/octet-stream"      },
-    {   "bz2",      "application/x-bzip2"           },
-    {   "css",      "text/css"                      },
-    {   "csv",      "text/csv"                      },
-    {   "doc",      "application/msword"            },
-    {   "dtd",      "text/xml"                      },
-    {   "dump",     "application/octet-stream"      },
-    {   "ps",       "application/postscript"        },
-    {   "exe",      "application/octet-stream"      },
-    {   "gif",      "image/gif"                     },
-    {   "gz",       "application/x-gzip"            },
-    {   "htm",      "text/html"                     },
-    {   "html",     "text/html"                     },
-    {   "jpe",      "image/jpeg"                    },
-    {   "jpeg",     "image/jpeg"                    },
-    {   "jpg",      "image/jpeg"                    },
-    {   "js",       "text/javascript"               },
-    {   "latex",    "application/x-latex"           },
-    {   "midi",     "audio/midi"                    },
-    {   "mp3",      "audio/mpeg"                    },
-    {   "mpeg",     "video/mpeg"                    },
-    {   "o",        "application/octet-stream"      },
-    {   "pdf",      "application/pdf"               },
-    {   "png",      "image/png"                     },
-    {   "ppt",      "application/powerpoint"        },
-    {   "ra",       "audio/x-pn-realaudio"          },
-    {   "ram",      "audio/x-pn-realaudio"          },
-    {   "rm",       "audio/x-pn-realaudio"          },
-    {   "rtf",      "application/rtf"               },
-    {   "swf",      "application/x-shockwave-flash" },
-    {   "tar",      "application/x-tar"             },
-    {   "tex",      "application/x-tex"             },
-    {   "tgz",      "application/x-gzip"            },
-    {   "tif",      "image/tiff"                    },
-    {   "tiff",     "image/tiff"                    },
-    {   "txt",      "text/plain"                    },
-    {   "wav",      "audio/wav"                     },
-    {   "xbm",      "image/x-xbitmap"               },
-    {   "xml",      "text/xml"                      },
-    {   "xpm",      "image/x-xpixmap"               },
-    {   "zip",      "application/zip"               },
+    {   "avi",      "video/x-msvideo",              0 },
+    {   "bin",      "application/octet-stream",     0 },
+    {   "bz2",      "application/x-bzip2",          0 },
+    {   "css",      "text/css",                     1 },
+    {   "csv",      "text/csv",                     1 },
+    {   "doc",      "application/msword",           0 },
+    {   "dtd",      "text/xml",                     1 },
+    {   "dump",     "application/octet-stream",     0 },
+    {   "ps",       "application/postscript",       1 },
+    {   "exe",      "application/octet-stream",     0 },
+    {   "gif",      "image/gif",                    0 },
+    {   "gz",       "application/x-gzip",           0 },
+    {   "htm",      "text/html",                    1 },
+    {   "html",     "text/html",                    1 },
+    {   "jpe",      "image/jpeg",                   0 },
+    {   "jpeg",     "image/jpeg",                   0 },
+    {   "jpg",      "image/jpeg",                   0 },
+    {   "js",       "text/javascript",              1 },
+    {   "latex",    "application/x-latex",          1 },
+    {   "midi",     "audio/midi",                   0 },
+    {   "mp3",      "audio/mpeg",                   0 },
+    {   "mpeg",     "video/mpeg",                   0 },
+    {   "o",        "application/octet-stream",     0 },
+    {   "pdf",      "application/pdf",              0 },
+    {   "png",      "image/png",                    0 },
+    {   "ppt",      "application/powerpoint",       0 },
+    {   "ra",       "audio/x-pn-realaudio",         0 },
+    {   "ram",      "audio/x-pn-realaudio",         0 },
+    {   "rm",       "audio/x-pn-realaudio",         0 },
+    {   "rtf",      "application/rtf",              1 },
+    {   "swf",      "application/x-shockwave-flash", 0 },
+    {   "tar",      "application/x-tar",            1 },
+    {   "tex",      "application/x-tex",            1 },
+    {   "tgz",      "application/x-gzip",           0 },
+    {   "tif",      "image/tiff",                   0 },
+    {   "tiff",     "image/tiff",                   0 },
+    {   "txt",      "text/plain",                   1 },
+    {   "wav",      "audio/wav",                    0 },
+    {   "xbm",      "image/x-xbitmap",              1 },
+    {   "xml",      "text/xml",                     1 },
+    {   "xpm",      "image/x-xpixmap",              1 },
+    {   "zip",      "application/zip",              0 },
 };
 
 static
@@ -90,4 +91,17 @@ const char *mimetype_get(const char *name) {
     return "text/plain";
 }
 
+int mimetype_compressible(const char *name) {
+    int i;
+
+    name = strrchr(name, '.');
+    if (name != NULL) {
+        i = mimetype_find_def(name + 1);
+        if (i >= 0) {
+            return DEFAULT_MIME_TYPES[i].compressible;
+        }
+    }
+    return 1;                           /* text/plain */
+}
+
 /* vim: set ts=4 sw=4 expandtab: */
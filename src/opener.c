@@ -0,0 +1,317 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <aranea/aranea.h>
+
+/** Completion queue of an event loop
+ */
+struct opener_t {
+    int efd;                    /**< eventfd to wake up the event loop */
+    pthread_mutex_t lock;
+    struct opener_job_t *done;  /**< Pushed by the pool */
+    /* the fields below are only used by the event loop */
+    struct opener_job_t *ready; /**< Taken from done */
+    struct opener_job_t *free;
+};
+
+static pthread_t *threads_ = NULL;
+static int num_threads_ = 0;
+static int quit_ = 0;
+/* jobs are opened in order of submission */
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+static struct opener_job_t *head_ = NULL;
+static struct opener_job_t *tail_ = NULL;
+#if HAVE_FILECACHE == 1
+static struct filecache_t *checks_ = NULL;
+#endif
+
+static
+void opener_complete(struct opener_job_t *job) {
+    struct opener_t *owner = job->owner;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&owner->lock);
+    job->next = owner->done;
+    owner->done = job;
+    pthread_mutex_unlock(&owner->lock);
+    if (write(owner->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        A_ERR("write: eventfd %s", strerror(errno));
+    }
+}
+
+#if HAVE_FILECACHE == 1
+/** Take a queued cache entry (lock_ is held).
+ */
+static
+struct filecache_t *opener_pop_check() {
+    struct filecache_t *file = checks_;
+
+    if (file != NULL) {
+        checks_ = file->check_next;
+        file->check_next = NULL;
+    }
+    return file;
+}
+#endif
+
+static
+void *opener_main(void *A_UNUSED(arg)) {
+    struct opener_job_t *job;
+#if HAVE_FILECACHE == 1
+    struct filecache_t *file;
+#endif
+
+    for (;;) {
+        pthread_mutex_lock(&lock_);
+#if HAVE_FILECACHE == 1
+        while (!quit_ && head_ == NULL && checks_ == NULL) {
+#else
+        while (!quit_ && head_ == NULL) {
+#endif
+            pthread_cond_wait(&cond_, &lock_);
+        }
+        if (quit_) {
+            pthread_mutex_unlock(&lock_);
+            break;
+        }
+        job = head_;
+        if (job != NULL) {
+            head_ = job->next;
+            if (head_ == NULL) {
+                tail_ = NULL;
+            }
+        }
+#if HAVE_FILECACHE == 1
+        file = (job == NULL) ? opener_pop_check() : NULL;
+#endif
+        pthread_mutex_unlock(&lock_);
+
+#if HAVE_FILECACHE == 1
+        if (file != NULL) {
+            filecache_revalidate(file);
+            continue;
+        }
+#endif
+        job->fd = client_open_path(job->path, &job->st);
+        job->error = (job->fd == -1) ? errno : 0;
+#if HAVE_PRECOMPRESSED == 1
+        job->variants = (job->fd == -1) ? 0
+                : client_probe_variants(job->path, job->st.st_mtime);
+#endif
+        opener_complete(job);
+    }
+    return NULL;
+}
+
+int opener_init(int num) {
+    sigset_t set, old;
+    int i, ret;
+
+    threads_ = calloc(num, sizeof(pthread_t));
+    if (threads_ == NULL) {
+        A_ERR("Out of memory: %s", "opener");
+        return -1;
+    }
+    /* signals are handled by the main thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (i = 0; i < num; ++i) {
+        ret = pthread_create(&threads_[i], NULL, &opener_main, NULL);
+        if (ret != 0) {
+            A_ERR("pthread_create: %s", strerror(ret));
+            break;
+        }
+        ++num_threads_;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return (num_threads_ < num) ? -1 : 0;
+}
+
+void opener_cleanup() {
+    int i;
+
+    pthread_mutex_lock(&lock_);
+    quit_ = 1;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+    for (i = 0; i < num_threads_; ++i) {
+        pthread_join(threads_[i], NULL);
+    }
+    free(threads_);
+    threads_ = NULL;
+    num_threads_ = 0;
+    /* jobs left in the queue are dropped, the server is exiting */
+    head_ = tail_ = NULL;
+#if HAVE_FILECACHE == 1
+    checks_ = NULL;
+#endif
+}
+
+int opener_attach(struct server_t *server) {
+    struct opener_t *self;
+
+    self = calloc(1, sizeof(struct opener_t));
+    if (self == NULL) {
+        A_ERR("Out of memory: %s", "opener");
+        return -1;
+    }
+    self->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->efd == -1) {
+        A_ERR("eventfd: %s", strerror(errno));
+        free(self);
+        return -1;
+    }
+    if (poller_add(&server->poller, self->efd, POLLER_IN, self) != 0) {
+        close(self->efd);
+        free(self);
+        return -1;
+    }
+    pthread_mutex_init(&self->lock, NULL);
+    server->opener = self;
+    return 0;
+}
+
+static
+void opener_free_jobs(struct opener_job_t *job) {
+    struct opener_job_t *next;
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        if (job->fd != -1) {
+            close(job->fd);
+        }
+        free(job);
+    }
+}
+
+void opener_detach(struct server_t *server) {
+    struct opener_t *self = server->opener;
+
+    if (self == NULL) {
+        return;
+    }
+    poller_del(&server->poller, self->efd);
+    close(self->efd);
+    opener_free_jobs(self->done);
+    opener_free_jobs(self->ready);
+    opener_free_jobs(self->free);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+    server->opener = NULL;
+}
+
+struct opener_job_t *opener_alloc(struct opener_t *self) {
+    struct opener_job_t *job;
+
+    if (self == NULL) {
+        return NULL;
+    }
+    job = self->free;
+    if (job != NULL) {
+        self->free = job->next;
+    } else {
+        job = malloc(sizeof(struct opener_job_t));
+        if (job == NULL) {
+            A_ERR("Out of memory: %s", "opener_job_t");
+            return NULL;
+        }
+    }
+    job->fd = -1;
+    job->pending = 0;
+    job->client = NULL;
+    job->owner = self;
+    job->next = NULL;
+    return job;
+}
+
+void opener_release(struct opener_job_t *job) {
+    if (job->pending) {
+        job->client = NULL;             /* freed by opener_receive */
+        return;
+    }
+    job->client = NULL;
+    job->fd = -1;                       /* given to the client */
+    job->next = job->owner->free;
+    job->owner->free = job;
+}
+
+int opener_submit(struct opener_job_t *job, struct client_t *client) {
+    pthread_mutex_lock(&lock_);
+    if (quit_ || num_threads_ == 0) {
+        pthread_mutex_unlock(&lock_);
+        return -1;
+    }
+    job->fd = -1;
+    job->pending = 1;
+    job->client = client;
+    job->next = NULL;
+    if (tail_ != NULL) {
+        tail_->next = job;
+    } else {
+        head_ = job;
+    }
+    tail_ = job;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    return 0;
+}
+
+#if HAVE_FILECACHE == 1
+int opener_revalidate(struct filecache_t *file) {
+    pthread_mutex_lock(&lock_);
+    if (quit_ || num_threads_ == 0) {
+        pthread_mutex_unlock(&lock_);
+        return -1;
+    }
+    /* opening files comes first, the order of checks does not matter */
+    file->check_next = checks_;
+    checks_ = file;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    return 0;
+}
+#endif
+
+struct client_t *opener_receive(struct opener_t *self) {
+    struct opener_job_t *job;
+    uint64_t cnt;
+
+    if (self->ready == NULL) {
+        if (read(self->efd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN) {
+            A_ERR("read: eventfd %s", strerror(errno));
+        }
+        pthread_mutex_lock(&self->lock);
+        self->ready = self->done;
+        self->done = NULL;
+        pthread_mutex_unlock(&self->lock);
+    }
+    while ((job = self->ready) != NULL) {
+        self->ready = job->next;
+        job->pending = 0;
+        if (job->client != NULL) {
+            return job->client;
+        }
+        /* the client has gone (timeout) */
+        if (job->fd != -1) {
+            close(job->fd);
+            job->fd = -1;
+        }
+        opener_release(job);
+    }
+    return NULL;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
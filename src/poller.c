@@ -0,0 +1,280 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#define _GNU_SOURCE                     /* accept4 */
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#if HAVE_EPOLL == 1
+# include <sys/epoll.h>
+#else
+# include <sys/select.h>
+# include <sys/time.h>
+#endif
+
+#include <aranea/aranea.h>
+
+#if HAVE_EPOLL == 1
+
+static
+unsigned int poller_to_epoll(unsigned int events) {
+    unsigned int ev = 0;
+
+    if (events & POLLER_IN) {
+        ev |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events & POLLER_OUT) {
+        ev |= EPOLLOUT;
+    }
+    if (events & POLLER_ET) {
+        ev |= EPOLLET;
+    }
+    return ev;
+}
+
+int poller_init(struct poller_t *self) {
+#if HAVE_IOURING == 1
+    /* epoll if the kernel does not support it */
+    self->uring = uring_init();
+    if (self->uring != NULL) {
+        A_LOG("poller: %s", "io_uring");
+        self->fd = -1;
+        return 0;
+    }
+#endif
+    self->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (self->fd == -1) {
+        A_ERR("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void poller_close(struct poller_t *self) {
+#if HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        uring_close(self->uring);
+        return;
+    }
+#endif
+    /* memory is left untouched, it may be shared with a vfork parent */
+    if (self->fd != -1) {
+        close(self->fd);
+    }
+}
+
+int poller_add(struct poller_t *self, int fd, unsigned int events, void *data) {
+    struct epoll_event ev;
+
+#if HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_add(self->uring, fd, events, data);
+    }
+#endif
+    ev.events = poller_to_epoll(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(self->fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        A_ERR("epoll_ctl: add %d %s", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int poller_mod(struct poller_t *self, int fd, unsigned int events, void *data) {
+    struct epoll_event ev;
+
+#if HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_mod(self->uring, fd, events, data);
+    }
+#endif
+    ev.events = poller_to_epoll(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(self->fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        A_ERR("epoll_ctl: mod %d %s", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int poller_del(struct poller_t *self, int fd) {
+    struct epoll_event ev;        /* for kernel before 2.6.9 */
+
+#if HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_del(self->uring, fd);
+    }
+#endif
+    if (epoll_ctl(self->fd, EPOLL_CTL_DEL, fd, &ev) == -1) {
+        A_ERR("epoll_ctl: del %d %s", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int poller_wait(struct poller_t *self, struct poller_event_t *events,
+        int max, int timeout) {
+    struct epoll_event ev[MAX_POLL_EVENTS];
+    int num, i;
+
+#if HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_wait(self->uring, events, max, timeout);
+    }
+#endif
+    if (max > MAX_POLL_EVENTS) {
+        max = MAX_POLL_EVENTS;
+    }
+    num = epoll_wait(self->fd, ev, max, timeout);
+    for (i = 0; i < num; ++i) {
+        events[i].data = ev[i].data.ptr;
+        events[i].events = 0;
+        /* errors are reported to both directions so the handler finds out */
+        if (ev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            events[i].events |= POLLER_IN;
+        }
+        if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            events[i].events |= POLLER_OUT;
+        }
+    }
+    return num;
+}
+
+#else   /* select */
+
+int poller_init(struct poller_t *self) {
+    FD_ZERO(&self->rfds);
+    FD_ZERO(&self->wfds);
+    self->max_fd = -1;
+    memset(self->data, 0, sizeof(self->data));
+    return 0;
+}
+
+void poller_close(struct poller_t *self) {
+    (void)self;
+}
+
+int poller_mod(struct poller_t *self, int fd, unsigned int events, void *data) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        A_ERR("select: fd %d exceeds FD_SETSIZE", fd);
+        return -1;
+    }
+    if (events & POLLER_IN) {
+        FD_SET(fd, &self->rfds);
+    } else {
+        FD_CLR(fd, &self->rfds);
+    }
+    if (events & POLLER_OUT) {
+        FD_SET(fd, &self->wfds);
+    } else {
+        FD_CLR(fd, &self->wfds);
+    }
+    self->data[fd] = data;
+    return 0;
+}
+
+int poller_add(struct poller_t *self, int fd, unsigned int events, void *data) {
+    if (poller_mod(self, fd, events, data) != 0) {
+        return -1;
+    }
+    if (fd > self->max_fd) {
+        self->max_fd = fd;
+    }
+    return 0;
+}
+
+int poller_del(struct poller_t *self, int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return -1;
+    }
+    FD_CLR(fd, &self->rfds);
+    FD_CLR(fd, &self->wfds);
+    self->data[fd] = NULL;
+    while (self->max_fd >= 0 && self->data[self->max_fd] == NULL) {
+        --self->max_fd;
+    }
+    return 0;
+}
+
+int poller_wait(struct poller_t *self, struct poller_event_t *events,
+        int max, int timeout) {
+    fd_set rfds, wfds;
+    struct timeval tv;
+    int num, fd, i;
+
+    rfds = self->rfds;
+    wfds = self->wfds;
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+    }
+    num = select(self->max_fd + 1, &rfds, &wfds, NULL,
+            (timeout >= 0) ? &tv : NULL);
+    if (num <= 0) {
+        return num;
+    }
+    /* Level triggered: the rest is reported again in the next call */
+    i = 0;
+    for (fd = 0; fd <= self->max_fd && i < max && num > 0; ++fd) {
+        events[i].events = 0;
+        if (FD_ISSET(fd, &rfds)) {
+            events[i].events |= POLLER_IN;
+        }
+        if (FD_ISSET(fd, &wfds)) {
+            events[i].events |= POLLER_OUT;
+        }
+        if (events[i].events != 0) {
+            events[i].data = self->data[fd];
+            ++i;
+            --num;
+        }
+    }
+    return i;
+}
+
+#endif  /* HAVE_EPOLL */
+
+int poller_accept(struct poller_t *self, int fd, struct sockaddr *addr,
+        socklen_t *len) {
+#if HAVE_EPOLL == 1 && HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_accept(self->uring, fd, addr, len);
+    }
+#else
+    (void)self;
+#endif
+#if HAVE_ACCEPT4 == 1
+    return accept4(fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    return accept(fd, addr, len);
+#endif
+}
+
+ssize_t poller_recv(struct poller_t *self, int fd, void *buf, size_t len) {
+#if HAVE_EPOLL == 1 && HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_recv(self->uring, fd, buf, len);
+    }
+#else
+    (void)self;
+#endif
+    return recv(fd, buf, len, 0);
+}
+
+ssize_t poller_sendmsg(struct poller_t *self, int fd,
+        const struct msghdr *msg, int flags) {
+#if HAVE_EPOLL == 1 && HAVE_IOURING == 1
+    if (self->uring != NULL) {
+        return uring_sendmsg(self->uring, fd, msg, flags);
+    }
+#else
+    (void)self;
+#endif
+    return sendmsg(fd, msg, flags);
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -3,7 +3,9 @@
  * See LICENSE file for copyright and license details.
  */
 
+#define _GNU_SOURCE                     /* accept4 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -17,17 +19,80 @@
 
 #include <aranea/aranea.h>
 
+/** Put the client at the end of the ready list
+ */
+static
+void server_add_ready(struct server_t *self, struct client_t *c) {
+    c->ready_next = NULL;
+    c->ready_prev = self->ready_tail;
+    *self->ready_tail = c;
+    self->ready_tail = &c->ready_next;
+}
+
+static
+void server_remove_ready(struct server_t *self, struct client_t *c) {
+    *c->ready_prev = c->ready_next;
+    if (c->ready_next != NULL) {
+        c->ready_next->ready_prev = c->ready_prev;
+    } else {
+        self->ready_tail = c->ready_prev;
+    }
+    c->ready_prev = NULL;
+}
+
 /**
- * Close, detach and free client
+ * Unregister, close and detach client. It is freed by the next loop, an
+ * event of the same batch (or a completion of the pool) may still refer
+ * to it.
  */
 static
-void forget_client(struct client_t *c) {
+void forget_client(struct server_t *self, struct client_t *c) {
+    if (c->remote_fd != -1) {
+        poller_del(&self->poller, c->remote_fd);
+    }
+    if (c->ready_prev != NULL) {
+        server_remove_ready(self, c);
+    }
+    timer_remove(&self->timers, c);
     client_close(c);
     client_detach(c);
-    clientpool_free(c);
+    c->state = STATE_NONE;
+    client_add(c, &self->closed);
+    --self->num_clients;
+#if HAVE_THREAD == 1
+    if (self->thread != NULL) {
+        thread_release(self->thread);
+    }
+#endif
 }
 
-int server_init(struct server_t *self) {
+static
+void server_free_closed(struct server_t *self) {
+    struct client_t *c;
+
+    while ((c = self->closed) != NULL) {
+        client_detach(c);
+        clientpool_free(c);
+    }
+}
+
+static
+int server_set_nonblock(int fd) {
+    int flags;
+
+    flags = fcntl(fd, F_GETFL, NULL);
+    if (flags == -1) {
+        A_ERR("fcntl: F_GETFL %s", strerror(errno));
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        A_ERR("fcntl: F_SETFL O_NONBLOCK %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int server_listen(struct server_t *self, int reuseport) {
     struct addrinfo hints, *info, *p;
     int enable = 1;
     int fd;
@@ -43,6 +108,7 @@ int server_init(struct server_t *self) {
         return -1;
     }
     /* loop through all the results and bind to the first we can */
+    fd = -1;
     for (p = info; p != NULL; p = p->ai_next) {
         fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
         if (fd == -1) {
@@ -50,30 +116,81 @@ int server_init(struct server_t *self) {
             continue;
         }
         if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1) {
-            close(fd);
             A_ERR("setsockopt: %s", strerror(errno));
-            return -1;
+            close(fd);
+            fd = -1;
+            break;
         }
-        if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                sizeof(int)) == -1) {
+            A_ERR("setsockopt: SO_REUSEPORT %s", strerror(errno));
             close(fd);
+            fd = -1;
+            break;
+        }
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
             A_ERR("bind: %s", strerror(errno));
+            close(fd);
+            fd = -1;
             continue;
         }
         break;
     }
-    if (p == NULL) {
-        A_ERR("bind: %s", strerror(errno));
+    freeaddrinfo(info);
+    if (fd == -1) {
         return -1;
     }
-    freeaddrinfo(info);
 
-    if (listen(fd, MAX_CONN) == -1) {
+    /* connections are accepted until the queue is empty */
+    if (server_set_nonblock(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, g_config.backlog) == -1) {
         close(fd);
         A_ERR("listen: %s", strerror(errno));
         return -1;
     }
     A_LOG("listen %s", self->port);
-    self->fd = fd;
+    return fd;
+}
+
+/** Response to connections over the limit, rendered once */
+static char reject_[256];
+static int reject_length_ = 0;
+
+int server_init(struct server_t *self) {
+    struct response_t response;
+
+    memset(&response, 0, sizeof(response));
+    response.status_code = HTTP_STATUS_SERVICEUNAVAILABLE;
+    reject_length_ = http_gen_errorpage(&response, reject_, sizeof(reject_));
+
+    /* a worker process already has its own listening socket */
+    if (self->fd == -1) {
+        self->fd = server_listen(self, 0);
+        if (self->fd == -1) {
+            return -1;
+        }
+    }
+    if (poller_init(&self->poller) != 0) {
+        return -1;
+    }
+    /* level triggered: a batch of connections is accepted each time */
+    if (poller_add(&self->poller, self->fd, POLLER_IN | POLLER_ACCEPT, self)
+            != 0) {
+        poller_close(&self->poller);
+        return -1;
+    }
+    timer_init(&self->timers, time(NULL));
+    self->ready = NULL;
+    self->ready_tail = &self->ready;
+    self->closed = NULL;
+    self->turn = 0;
+#if HAVE_OPENPOOL == 1
+    /* files are opened in the same thread without it */
+    opener_attach(self);
+#endif
     return 0;
 }
 
@@ -85,169 +202,246 @@ int server_init(struct server_t *self) {
     ? (void *)&(((struct sockaddr_in *)(sa))->sin_addr)         \
     : (void *)&(((struct sockaddr_in6 *)(sa))->sin6_addr)
 
-struct client_t *server_accept(struct server_t *self) {
+int server_accept(struct server_t *self, char *ip, int sz) {
     socklen_t len;
     struct sockaddr_storage addr;
     int fd;
-    int flags;
-    struct client_t *c;
 
     len = sizeof(addr);
-    fd = accept(self->fd, (struct sockaddr *)&addr, &len);
+    fd = poller_accept(&self->poller, self->fd, (struct sockaddr *)&addr,
+            &len);
     if (fd == -1) {
-        A_ERR("accept: %s", strerror(errno));
-        return NULL;
-    }
-    /* set socket to non-blocking */
-    flags = fcntl(fd, F_GETFL, NULL);
-    if (flags == -1) {
-        A_ERR("fcntl: F_GETFL %s", strerror(errno));
-        goto err;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            A_ERR("accept: %s", strerror(errno));
+        }
+        return -1;
     }
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        A_ERR("fcntl: F_SETFL O_NONBLOCK %s", strerror(errno));
-        goto err;
+#if HAVE_ACCEPT4 == 0
+    if (server_set_nonblock(fd) != 0) {
+        close(fd);
+        return -1;
     }
-#if HAVE_TCPCORK == 1
-    flags = 1;
-    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flags,
-            sizeof(flags)) == -1) {
-        goto err;
+#endif
+    inet_ntop(addr.ss_family, SERVER_GETINADDR_(&addr), ip, sz);
+    A_LOG("accept %d %s", fd, ip);
+    return fd;
+}
+#undef SERVER_GETINADDR_
+
+void server_reject(int fd) {
+    A_LOG("reject %d", fd);
+    /* best effort, the socket buffer is empty */
+    if (send(fd, reject_, reject_length_, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        A_LOG("send: %s", strerror(errno));
     }
+    close(fd);
+}
+
+#if HAVE_CGI == 1
+/* a CGI script reads the body from the socket, nothing may be received
+ * in advance */
+# define SERVER_STREAM_         0
+#else
+# define SERVER_STREAM_         POLLER_STREAM
 #endif
+
+/** Run state handlers until the socket would block, then update the
+ * interest in the poller if the client is still alive.
+ */
+static
+void server_handle(struct server_t *self, struct client_t *c);
+
+void server_attach(struct server_t *self, int fd, const char *ip) {
+    struct client_t *c;
+
     c = clientpool_alloc();
     if (c == NULL) {
         goto err;
     }
     client_init(c);
+    /* register once, interest is changed when the state does */
+    if (poller_add(&self->poller, fd, POLLER_IN | POLLER_ET | SERVER_STREAM_,
+                c) != 0) {
+        clientpool_free(c);
+        goto err;
+    }
     /* save client information */
     c->remote_fd = fd;
     c->state = STATE_RECV_HEADER;
-    inet_ntop(addr.ss_family, SERVER_GETINADDR_(&addr), c->ip, sizeof(c->ip));
-    A_LOG("accept %d %s", fd, c->ip);
-    return c;
+    c->events = POLLER_IN;
+    c->turn = self->turn - 1;           /* given a quota now */
+    strncpy(c->ip, ip, sizeof(c->ip) - 1);
+    c->ip[sizeof(c->ip) - 1] = '\0';
+    c->timeout = g_curtime + CLIENT_TIMEOUT;
+    client_add(c, &self->clients);
+    timer_add(&self->timers, c);
+    ++self->num_clients;
+    /* Read header straightway */
+    server_handle(self, c);
+    return;
 err:
     close(fd);
-    return NULL;
+#if HAVE_THREAD == 1
+    if (self->thread != NULL) {
+        thread_release(self->thread);
+    }
+#endif
 }
-#undef SERVER_GETINADDR_
-
-#define SERVER_SETFD_(fd, set, max)     \
-    do {                                \
-        FD_SET(fd, set);                \
-        if (fd > max) {                 \
-            max = fd;                   \
-        }                               \
-    } while (0)
-void server_poll(struct server_t *self) {
-    fd_set rfds, wfds;
-    int max_rfd, max_wfd;
-    int num_fd;
-    time_t chk_time;
-    struct timeval timeout;
-    struct client_t *c, *tc;
 
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    max_rfd = max_wfd = -1;
-    SERVER_SETFD_(self->fd, &rfds, max_rfd);
+static
+void server_handle(struct server_t *self, struct client_t *c) {
+    unsigned int events;
+    int again;
 
-    g_curtime = time(NULL);
-    for (c = self->clients; c != NULL; ) {
-        if (g_curtime > c->timeout) {
-            A_LOG("timeout client %d", c->remote_fd);
-            tc = c;
-            c = c->next;
-            forget_client(tc);
-            continue;
-        }
+    /* once per loop, a client of the ready list may also have an event */
+    if (c->turn != self->turn) {
+        c->turn = self->turn;
+        c->quota = SENDFILE_QUOTA;
+    }
+    do {
         switch (c->state) {
         case STATE_RECV_HEADER:
-            SERVER_SETFD_(c->remote_fd, &rfds, max_rfd);
+            again = state_recv_header(c);
             break;
         case STATE_SEND_HEADER:
+            again = state_send_header(c);
+            break;
         case STATE_SEND_FILE:
-            SERVER_SETFD_(c->remote_fd, &wfds, max_wfd);
+            again = state_send_file(c);
+            break;
+        case STATE_SEND_PARTS:
+            again = state_send_parts(c);
+            break;
+#if HAVE_FILECACHE == 1
+        case STATE_SEND_MEMORY:
+            again = state_send_memory(c);
+            break;
+#endif
+#if HAVE_OPENPOOL == 1
+        case STATE_OPENING:
+            /* the interest is kept, handled again by the opener event */
+            return;
+#endif
+        default:
+            A_LOG("client: %d invalid state %d", c->remote_fd, c->state);
+            c->state = STATE_NONE;
+            again = 0;
             break;
         }
-        c = c->next;
+    } while (again && c->state != STATE_NONE);
+
+    if (c->state == STATE_NONE) {
+        /* finished connection */
+        A_LOG("close client %d", c->remote_fd);
+        forget_client(self, c);
+        return;
     }
-    /* Poll timeout (to check quit flag) */
-    timeout.tv_sec = SERVER_TIMEOUT;
-    timeout.tv_usec = 0;
-    for (;;) {
-        num_fd = select((max_rfd > max_wfd) ? (max_rfd + 1) : (max_wfd + 1),
-                &rfds, (max_wfd != -1) ? &wfds : NULL,
-                NULL, &timeout);
-        if (num_fd > 0) {
-            break;
+    /* the socket may still be writable, no event would come (edge) */
+    if ((c->state == STATE_SEND_FILE || c->state == STATE_SEND_PARTS)
+            && c->quota <= 0
+            && c->ready_prev == NULL) {
+        server_add_ready(self, c);
+    }
+    events = (c->state == STATE_RECV_HEADER) ? POLLER_IN : POLLER_OUT;
+    if (events != c->events) {
+        if (poller_mod(&self->poller, c->remote_fd,
+                    events | POLLER_ET | SERVER_STREAM_, c) != 0) {
+            forget_client(self, c);
+            return;
         }
-        if (num_fd < 0) {
-            /* Ignore Interrupted system call which caused by ending of a
-               child process */
-            if (errno == EINTR) {
-                continue;
-            } else {
-                A_ERR("select: %s", strerror(errno));
-                sleep(1);
-            }
+        c->events = events;
+    }
+}
+
+void server_poll(struct server_t *self) {
+    struct poller_event_t events[MAX_POLL_EVENTS];
+    char ip[MAX_IP_LENGTH];
+    int num, i, n, fd, timeout;
+    time_t chk_time;
+    struct client_t *c, *tc;
+
+    /* no event of the previous batch is left */
+    server_free_closed(self);
+    ++self->turn;
+    g_curtime = time(NULL);
+    /* round robin: each one sends its quota again, then the events of
+     * this loop are handled */
+    for (n = 0, c = self->ready; c != NULL; c = c->ready_next) {
+        ++n;
+    }
+    while (n-- > 0) {
+        c = self->ready;
+        server_remove_ready(self, c);
+        c->timeout = g_curtime + CLIENT_TIMEOUT;
+        server_handle(self, c);
+    }
+    /* only clients in the due buckets are checked */
+    for (c = timer_expire(&self->timers, g_curtime); c != NULL; ) {
+        A_LOG("timeout client %d", c->remote_fd);
+        tc = c;
+        c = c->timer_next;
+        forget_client(self, tc);
+    }
+    /* Sleep until the next deadline, but still check quit flag regularly */
+    timeout = timer_next(&self->timers);
+    if (timeout < 0 || timeout > SERVER_TIMEOUT) {
+        timeout = SERVER_TIMEOUT;
+    }
+    if (self->ready != NULL) {
+        timeout = 0;
+    }
+    num = poller_wait(&self->poller, events, A_SIZEOF(events),
+            timeout * 1000);
+    if (num <= 0) {
+        /* Interrupted system call (signal) goes back to the main loop
+           so that the quit flag is checked without delay */
+        if (num < 0 && errno != EINTR) {
+            A_ERR("poll: %s", strerror(errno));
+            sleep(1);
         }
         return;
     }
     g_curtime = time(NULL);
     chk_time = g_curtime + CLIENT_TIMEOUT;
-    if (FD_ISSET(self->fd, &rfds)) {
-        c = server_accept(self);
-        if (c != NULL) {
-            client_add(c, &self->clients);
-            c->timeout = chk_time;
-            /* Read header straightway */
-            state_recv_header(c);
-            if (c->state == STATE_NONE) {
-                forget_client(c);
+    for (i = 0; i < num; ++i) {
+        if (events[i].data == self) {
+            /* drain the queue, but leave some time to other clients */
+            for (n = 0; n < MAX_ACCEPT_PER_POLL; ++n) {
+                fd = server_accept(self, ip, sizeof(ip));
+                if (fd == -1) {
+                    break;
+                }
+                if (self->num_clients >= g_config.max_conn) {
+                    server_reject(fd);
+                } else {
+                    server_attach(self, fd, ip);
+                }
             }
+            continue;
         }
-        --num_fd;
-    }
-    for (c = self->clients; num_fd > 0 && c != NULL; ) {
-        switch (c->state) {
-        case STATE_NONE:
-            break;
-        case STATE_RECV_HEADER:
-            if (FD_ISSET(c->remote_fd, &rfds)) {
-                c->timeout = chk_time;
-                state_recv_header(c);
-                --num_fd;
-            }
-            break;
-        case STATE_SEND_HEADER:
-            if (FD_ISSET(c->remote_fd, &wfds)) {
-                c->timeout = chk_time;
-                state_send_header(c);
-                --num_fd;
-            }
-            break;
-        case STATE_SEND_FILE:
-            if (FD_ISSET(c->remote_fd, &wfds)) {
+#if HAVE_THREAD == 1
+        if (self->thread != NULL && events[i].data == self->thread) {
+            thread_receive(self);
+            continue;
+        }
+#endif
+#if HAVE_OPENPOOL == 1
+        if (self->opener != NULL && events[i].data == self->opener) {
+            while ((c = opener_receive(self->opener)) != NULL) {
+                /* opener_receive skips the jobs of closed clients */
                 c->timeout = chk_time;
-                state_send_file(c);
-                --num_fd;
+                client_opened(c);
+                server_handle(self, c);
             }
-            break;
-        default:
-            A_LOG("client: %d invalid state %d", c->remote_fd, c->state);
-            c->state = STATE_NONE;
-            break;
+            continue;
         }
+#endif
+        c = events[i].data;
         if (c->state == STATE_NONE) {
-            /* finished connection */
-            A_LOG("close client %d", c->remote_fd);
-            tc = c;
-            c = c->next;
-            forget_client(tc);
-        } else {
-            c = c->next;
+            continue;                   /* closed by a previous event */
         }
+        c->timeout = chk_time;
+        server_handle(self, c);
     }
 }
 
@@ -257,7 +451,10 @@ void server_poll(struct server_t *self) {
 void server_close_fds() {
     struct client_t *c;
 
-    close(g_server.fd);
+    poller_close(&g_server.poller);
+    if (g_server.fd != -1) {
+        close(g_server.fd);
+    }
     for (c = g_server.clients; c != NULL; c = c->next) {
         close(c->remote_fd);
         if (c->local_rfd != -1) {
@@ -266,4 +463,26 @@ void server_close_fds() {
     }
 }
 
+void server_close(struct server_t *self) {
+    struct client_t *c, *tc;
+
+    for (c = self->clients; c != NULL; ) {
+        tc = c;
+        c = c->next;
+        client_close(tc);
+        free(tc);
+    }
+    self->clients = NULL;
+    self->num_clients = 0;
+    server_free_closed(self);
+#if HAVE_OPENPOOL == 1
+    opener_detach(self);
+#endif
+    poller_close(&self->poller);
+    if (self->fd != -1) {
+        close(self->fd);
+        self->fd = -1;
+    }
+}
+
 /* vim: set ts=4 sw=4 expandtab: */
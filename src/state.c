@@ -7,9 +7,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <aranea/aranea.h>
 
@@ -25,74 +29,221 @@
                 A_ERR("%s: client %d %s", method, client->remote_fd, strerror(errno)); \
                 client->state = STATE_NONE;                                 \
             }                                                               \
-            return;                                                         \
+            return 0;                                                       \
         } else if (rv == 0) {                                               \
             /* this connection is closed */                                 \
             client->state = STATE_NONE;                                     \
-            return;                                                         \
+            return 0;                                                       \
         }                                                                   \
     } while (0)
 
+/** Look for the end of the header in the received data, starting from the
+ * given offset, and process the request once it is complete.
+ */
+static
+void state_parse_header(struct client_t *client, ssize_t from) {
+    ssize_t len;
+
+    len = http_find_headerlength(client->data, client->data_length, from);
+    if (len < 0) {
+        /* Not found, check if data size is too large */
+        if (client->data_length >= (ssize_t)sizeof(client->data)) {
+            client->response.status_code = HTTP_STATUS_ENTITYTOOLARGE;
+            client->data_length = http_gen_errorpage(&client->response,
+                    client->data, sizeof(client->data));
+            client->state = STATE_SEND_HEADER;
+        }
+        return;
+    }
+    client->request.header_length = len;
+    /* Bytes of the next requests (or the body) are moved to the end of the
+     * buffer, out of the way of the response */
+    client->data_pipelined = client->data_length - len;
+    if (client->data_pipelined > 0) {
+        memmove(client->data + sizeof(client->data) - client->data_pipelined,
+                client->data + len, client->data_pipelined);
+    }
+    client->data_length = len;
+    client_process(client);
+}
+
 static
 void state_finish(struct client_t *client) {
+    ssize_t pipelined;
+
     if (client->flags & CLIENT_FLAG_KEEPALIVE) {
+        pipelined = client->data_pipelined;
         client_reset(client);
         client->state = STATE_RECV_HEADER;
+        /* Next request was already received */
+        if (pipelined > 0) {
+            memmove(client->data,
+                    client->data + sizeof(client->data) - pipelined,
+                    pipelined);
+            client->data_length = pipelined;
+            state_parse_header(client, 0);
+        }
     } else {
         client->state = STATE_NONE;
     }
 }
 
-/** Read header from socket
+/** Cork (or uncork to flush) the socket around a header and file pair.
+ * Without TCP_CORK, the header is sent with MSG_MORE instead.
  */
-void state_recv_header(struct client_t *client) {
-    ssize_t len;
+static
+void state_cork(struct client_t *client, int on) {
+#if HAVE_TCPCORK == 1
+    if (setsockopt(client->remote_fd, IPPROTO_TCP, TCP_CORK, &on,
+            sizeof(on)) == -1) {
+        A_ERR("setsockopt: TCP_CORK %s", strerror(errno));
+        return;
+    }
+    if (on) {
+        client->flags |= CLIENT_FLAG_CORKED;
+    } else {
+        client->flags &= ~CLIENT_FLAG_CORKED;
+    }
+#else
+    (void)client;
+    (void)on;
+#endif
+}
 
-    /* Just peek the data to find the end of the header */
-    if (client->request.header_length <= 0) {
-        len = recv(client->remote_fd, client->data, sizeof(client->data),
-                MSG_PEEK);
-        CHECK_NONBLOCKING_ERROR(len, client, "peek");
-        /* Check header termination */
-        if (len > 4) {
-            client->request.header_length = http_find_headerlength(client->data,
-                    len);
-            if (client->request.header_length < 0) {
-                /* Not found, check if data size is too large */
-                if (len >= MAX_REQUEST_LENGTH) {
-                    client->response.status_code = HTTP_STATUS_ENTITYTOOLARGE;
-                    client->data_length = http_gen_errorpage(&client->response,
-                            client->data, sizeof(client->data));
-                    client->state = STATE_SEND_HEADER;
-                }
-            }
+static
+void state_finish_file(struct client_t *client) {
+    client_close_file(client);
+    if (client->flags & CLIENT_FLAG_CORKED) {
+        state_cork(client, 0);
+    }
+    state_finish(client);
+}
+
+#if HAVE_READAHEAD == 1
+/** Ask the kernel for the next window of a large file ahead of offset, so
+ * that sendfile finds the pages in the cache rather than waiting for the
+ * disk in the event loop. The readahead is started asynchronously once
+ * half of the previous window has been sent. The pages already sent are
+ * dropped from the cache for files above READAHEAD_DROP_LENGTH.
+ */
+static
+void state_readahead(struct client_t *client, off_t offset) {
+    off_t end, len;
+
+    if (client->local_rfd == -1
+            || client->response.total_length < READAHEAD_MIN_LENGTH) {
+        return;
+    }
+#if HAVE_COMPRESS == 1
+    if (client->zfile != NULL) {
+        return;                         /* in memory */
+    }
+#endif
+    end = client->response.content_from + client->response.content_length;
+    if (client->readahead < end
+            && offset + READAHEAD_WINDOW / 2 >= client->readahead) {
+        if (client->readahead < offset) {
+            client->readahead = offset;
+        }
+        len = end - client->readahead;
+        if (len > READAHEAD_WINDOW) {
+            len = READAHEAD_WINDOW;
         }
+        posix_fadvise(client->local_rfd, client->readahead, len,
+                POSIX_FADV_WILLNEED);
+        client->readahead += len;
     }
-    /* Already peeked, pull data from the socket until reaching this position */
-    if (client->request.header_length > 0) {
-        len = recv(client->remote_fd, client->data + client->data_length,
-                client->request.header_length - client->data_length, 0);
-        CHECK_NONBLOCKING_ERROR(len, client, "recv");
-        client->data_length += len;
-        if (client->data_length >= client->request.header_length) {
-            client_process(client);
+    if (READAHEAD_DROP_LENGTH > 0
+            && client->response.total_length >= READAHEAD_DROP_LENGTH) {
+        if (client->dropped < client->response.content_from) {
+            client->dropped = client->response.content_from;
+        }
+        if (offset - client->dropped >= READAHEAD_WINDOW) {
+            posix_fadvise(client->local_rfd, client->dropped,
+                    offset - client->dropped, POSIX_FADV_DONTNEED);
+            client->dropped = offset;
         }
     }
+}
+#endif
+
+/** send() through the poller, see poller_sendmsg
+ */
+static
+ssize_t state_send(struct client_t *client, const void *buf, size_t len,
+        int flags) {
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return poller_sendmsg(&g_server.poller, client->remote_fd, &msg, flags);
+}
+
+/** Read header from socket
+ */
+int state_recv_header(struct client_t *client) {
+    ssize_t len;
+
+    /* Header termination is searched incrementally in received data */
+    len = poller_recv(&g_server.poller, client->remote_fd,
+            client->data + client->data_length,
+            sizeof(client->data) - client->data_length);
+    CHECK_NONBLOCKING_ERROR(len, client, "recv");
+    client->data_length += len;
+    state_parse_header(client, client->data_length - len);
     /* Should not wait until next server loop to process this request */
-    if (client->state == STATE_SEND_HEADER) {
-        state_send_header(client);
-    }
+    return 1;
 }
 
-/** Send reply (header) via socket
+/** Send reply (header) via socket.
+ * A small file is read in g_buff and sent along with the header in a
+ * single call, a larger one follows with sendfile.
  */
-void state_send_header(struct client_t *client) {
+int state_send_header(struct client_t *client) {
+    struct iovec iov[2];
+    struct msghdr msg;
     ssize_t len;
+    int flags;
 
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    iov[0].iov_base = client->data + client->data_sent;
+    iov[0].iov_len = client->data_length - client->data_sent;
     /* MSG_NOSIGNAL: not to send SIGPIPE on errors on socket */
-    len = send(client->remote_fd, client->data + client->data_sent,
-                client->data_length - client->data_sent, MSG_NOSIGNAL);
+    flags = MSG_NOSIGNAL;
+    if (client->local_rfd != -1) {
+        len = client->response.content_length;
+        if (len > 0 && len <= (ssize_t)sizeof(g_buff)) {
+            len = pread(client->local_rfd, g_buff, len,
+                    client->response.content_from);
+            if (len > 0) {
+                iov[1].iov_base = g_buff;
+                iov[1].iov_len = len;
+                msg.msg_iovlen = 2;
+            }
+        }
+        if (msg.msg_iovlen == 1 && len > 0) {
+#if HAVE_TCPCORK == 1
+            if (!(client->flags & CLIENT_FLAG_CORKED)) {
+                state_cork(client, 1);
+            }
+#else
+            flags |= MSG_MORE;
+#endif
+        }
+    }
+    len = poller_sendmsg(&g_server.poller, client->remote_fd, &msg, flags);
     CHECK_NONBLOCKING_ERROR(len, client, "send");
+    if (len > (ssize_t)iov[0].iov_len) {
+        /* part of the body is sent too */
+        client->file_sent = len - iov[0].iov_len;
+        len = iov[0].iov_len;
+    }
     client->data_sent += len;
 
     /* check if finish sending header */
@@ -100,26 +251,143 @@ void state_send_header(struct client_t *client) {
         client->data_length = client->data_sent = 0;
         if (client->local_rfd == -1) {
             state_finish(client);
+        } else if (client->file_sent >= client->response.content_length) {
+            state_finish_file(client);
         } else {
             client->state = STATE_SEND_FILE;
         }
     }
+    return 1;
 }
 
-void state_send_file(struct client_t *client) {
+int state_send_file(struct client_t *client) {
     ssize_t len;
     off_t offset;
 
+    /* a large file is sent in several turns, see server_handle */
+    if (client->quota <= 0) {
+        return 0;
+    }
+    len = client->response.content_length - client->file_sent;
+    if (len > SENDFILE_CHUNK) {
+        len = SENDFILE_CHUNK;
+    }
+    if (len > client->quota) {
+        len = client->quota;
+    }
     offset = client->response.content_from + client->file_sent;
-    len = sendfile(client->remote_fd, client->local_rfd, &offset,
-            client->response.content_length - client->file_sent);
+#if HAVE_READAHEAD == 1
+    state_readahead(client, offset);
+#endif
+    len = sendfile(client->remote_fd, client->local_rfd, &offset, len);
     CHECK_NONBLOCKING_ERROR(len, client, "sendfile");
     client->file_sent += len;
+    client->quota -= len;
     if (client->file_sent >= client->response.content_length) {
-        close(client->local_rfd);
-        client->local_rfd = -1;
-        state_finish(client);
+        state_finish_file(client);
+    }
+    return 1;
+}
+
+/** Send a multipart/byteranges response: the boundary and the fields of
+ * each part (in data, with the header first) and then its range, from the
+ * cached content or with sendfile.
+ */
+int state_send_parts(struct client_t *client) {
+    ssize_t len;
+    off_t offset;
+    int flags;
+
+    if (client->quota <= 0) {
+        return 0;
+    }
+    if (client->data_sent < client->data_length) {
+        flags = MSG_NOSIGNAL;
+        if (client->response.part < client->response.num_parts) {
+#if HAVE_TCPCORK == 1
+            if (!(client->flags & CLIENT_FLAG_CORKED)) {
+                state_cork(client, 1);
+            }
+#else
+            flags |= MSG_MORE;
+#endif
+        }
+        len = state_send(client, client->data + client->data_sent,
+                client->data_length - client->data_sent, flags);
+        CHECK_NONBLOCKING_ERROR(len, client, "send");
+        client->data_sent += len;
+        if (client->data_sent < client->data_length) {
+            return 1;
+        }
+        client->data_length = client->data_sent = 0;
+        if (client->response.part >= client->response.num_parts) {
+            state_finish_file(client);
+        }
+        return 1;
+    }
+    len = client->response.content_length - client->file_sent;
+    if (len > SENDFILE_CHUNK) {
+        len = SENDFILE_CHUNK;
+    }
+    if (len > client->quota) {
+        len = client->quota;
+    }
+    offset = client->response.content_from + client->file_sent;
+#if HAVE_READAHEAD == 1
+    state_readahead(client, offset);
+#endif
+#if HAVE_FILECACHE == 1
+    if (client->file != NULL && client->file->content != NULL) {
+        len = state_send(client, client->file->content + offset, len,
+                MSG_NOSIGNAL | MSG_MORE);
+    } else
+#endif
+    len = sendfile(client->remote_fd, client->local_rfd, &offset, len);
+    CHECK_NONBLOCKING_ERROR(len, client, "sendfile");
+    client->file_sent += len;
+    client->quota -= len;
+    if (client->file_sent >= client->response.content_length) {
+        client->file_sent = 0;
+        if (client_next_part(client) != 0) {
+            A_ERR("part too large for client %d", client->remote_fd);
+            client->state = STATE_NONE;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if HAVE_FILECACHE == 1
+/** Send the rest of the header and the cached file with a single call
+ */
+int state_send_memory(struct client_t *client) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iov[0].iov_base = client->data + client->data_sent;
+    iov[0].iov_len = client->data_length - client->data_sent;
+    iov[1].iov_base = client->file->content + client->response.content_from
+            + client->file_sent;
+    iov[1].iov_len = client->response.content_length - client->file_sent;
+    len = poller_sendmsg(&g_server.poller, client->remote_fd, &msg,
+            MSG_NOSIGNAL);
+    CHECK_NONBLOCKING_ERROR(len, client, "send");
+    if (len < (ssize_t)iov[0].iov_len) {
+        client->data_sent += len;
+    } else {
+        client->data_sent = client->data_length;
+        client->file_sent += len - iov[0].iov_len;
+    }
+    if (client->file_sent >= client->response.content_length) {
+        client->data_length = client->data_sent = 0;
+        state_finish_file(client);
     }
+    return 1;
 }
+#endif
 
 /* vim: set ts=4 sw=4 expandtab: */
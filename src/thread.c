@@ -0,0 +1,237 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <aranea/aranea.h>
+
+/** Accepted connection handed to an I/O thread
+ */
+struct handoff_t {
+    int fd;
+    char ip[MAX_IP_LENGTH];
+};
+
+struct thread_t {
+    pthread_t tid;
+    int efd;                    /**< eventfd to wake up the thread */
+    int load;                   /**< Connections owned (atomic) */
+    int status;                 /**< Result of initialization */
+    /* Lock-free ring, the acceptor is the only producer and this thread
+     * the only consumer */
+    unsigned int head;          /**< Written by the consumer */
+    unsigned int tail;          /**< Written by the producer */
+    struct handoff_t ring[THREAD_RING_SIZE];
+};
+
+static struct thread_t *threads_ = NULL;
+static int num_threads_ = 0;
+static int quit_ = 0;
+/* threads report the result of their initialization */
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t started_cond_ = PTHREAD_COND_INITIALIZER;
+static int started_ = 0;
+
+static
+void thread_wakeup(struct thread_t *self) {
+    uint64_t one = 1;
+
+    if (write(self->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        A_ERR("write: eventfd %s", strerror(errno));
+    }
+}
+
+static
+void *thread_main(void *arg) {
+    struct thread_t *self = arg;
+
+    g_server.fd = -1;                   /* no listening socket */
+    g_server.thread = self;
+    g_curtime = time(NULL);
+    self->status = poller_init(&g_server.poller);
+    if (self->status == 0) {
+        self->status = poller_add(&g_server.poller, self->efd, POLLER_IN,
+                self);
+    }
+#if HAVE_OPENPOOL == 1
+    if (self->status == 0) {
+        self->status = opener_attach(&g_server);
+    }
+#endif
+    timer_init(&g_server.timers, g_curtime);
+    g_server.ready = NULL;
+    g_server.ready_tail = &g_server.ready;
+    g_server.closed = NULL;
+    g_server.turn = 0;
+    pthread_mutex_lock(&lock_);
+    ++started_;
+    pthread_cond_signal(&started_cond_);
+    pthread_mutex_unlock(&lock_);
+    if (self->status != 0) {
+        return NULL;
+    }
+    while (!__atomic_load_n(&quit_, __ATOMIC_ACQUIRE)) {
+        server_poll(&g_server);
+    }
+    server_close(&g_server);
+    clientpool_cleanup();
+    return NULL;
+}
+
+int thread_init(int num) {
+    sigset_t set, old;
+    int i, ret;
+
+    threads_ = calloc(num, sizeof(struct thread_t));
+    if (threads_ == NULL) {
+        A_ERR("Out of memory: %s", "thread_t");
+        return -1;
+    }
+    /* signals are handled by the main thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    ret = 0;
+    for (i = 0; i < num; ++i) {
+        threads_[i].efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (threads_[i].efd == -1) {
+            A_ERR("eventfd: %s", strerror(errno));
+            break;
+        }
+        ret = pthread_create(&threads_[i].tid, NULL, &thread_main,
+                &threads_[i]);
+        if (ret != 0) {
+            A_ERR("pthread_create: %s", strerror(ret));
+            close(threads_[i].efd);
+            break;
+        }
+        ++num_threads_;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_mutex_lock(&lock_);
+    while (started_ < num_threads_) {
+        pthread_cond_wait(&started_cond_, &lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+    if (num_threads_ < num) {
+        return -1;
+    }
+    for (i = 0; i < num; ++i) {
+        if (threads_[i].status != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Push the connection to the least loaded thread which has room for it
+ * @return -1 if the server is full.
+ */
+static
+int thread_dispatch(int fd, const char *ip) {
+    struct thread_t *t, *best;
+    struct handoff_t *item;
+    int i, load, min, total;
+
+    best = NULL;
+    min = 0;
+    total = 0;
+    for (i = 0; i < num_threads_; ++i) {
+        t = &threads_[i];
+        load = __atomic_load_n(&t->load, __ATOMIC_RELAXED);
+        total += load;
+        if (t->tail - __atomic_load_n(&t->head, __ATOMIC_ACQUIRE)
+                >= THREAD_RING_SIZE) {
+            continue;                       /* full */
+        }
+        if (best == NULL || load < min) {
+            best = t;
+            min = load;
+        }
+    }
+    if (best == NULL || total >= g_config.max_conn) {
+        return -1;
+    }
+    item = &best->ring[best->tail % THREAD_RING_SIZE];
+    item->fd = fd;
+    memcpy(item->ip, ip, sizeof(item->ip));
+    __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&best->load, 1, __ATOMIC_RELAXED);
+    thread_wakeup(best);
+    return 0;
+}
+
+void thread_accept(struct server_t *server) {
+    struct poller_event_t event;
+    char ip[MAX_IP_LENGTH];
+    int num, n, fd;
+
+    num = poller_wait(&server->poller, &event, 1, SERVER_TIMEOUT * 1000);
+    if (num <= 0) {
+        if (num < 0 && errno != EINTR) {
+            A_ERR("poll: %s", strerror(errno));
+            sleep(1);
+        }
+        return;
+    }
+    for (n = 0; n < MAX_ACCEPT_PER_POLL; ++n) {
+        fd = server_accept(server, ip, sizeof(ip));
+        if (fd == -1) {
+            break;
+        }
+        if (thread_dispatch(fd, ip) != 0) {
+            server_reject(fd);
+        }
+    }
+}
+
+void thread_receive(struct server_t *server) {
+    struct thread_t *self = server->thread;
+    struct handoff_t *item;
+    unsigned int head, tail;
+    uint64_t cnt;
+
+    if (read(self->efd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN) {
+        A_ERR("read: eventfd %s", strerror(errno));
+    }
+    head = self->head;
+    tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        item = &self->ring[head % THREAD_RING_SIZE];
+        server_attach(server, item->fd, item->ip);
+        ++head;
+        __atomic_store_n(&self->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+void thread_release(struct thread_t *self) {
+    __atomic_sub_fetch(&self->load, 1, __ATOMIC_RELAXED);
+}
+
+void thread_cleanup() {
+    int i;
+
+    __atomic_store_n(&quit_, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < num_threads_; ++i) {
+        thread_wakeup(&threads_[i]);
+    }
+    for (i = 0; i < num_threads_; ++i) {
+        pthread_join(threads_[i].tid, NULL);
+        close(threads_[i].efd);
+    }
+    free(threads_);
+    threads_ = NULL;
+    num_threads_ = 0;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
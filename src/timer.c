@@ -0,0 +1,135 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <aranea/aranea.h>
+
+/* Two levels of TIMER_SLOTS buckets: one second each in the first level,
+ * TIMER_SLOTS seconds each in the second one.
+ */
+#define TIMER_MASK_             (TIMER_SLOTS - 1)
+#define TIMER_SHIFT_            TIMER_BITS
+#define TIMER_RANGE_            (TIMER_SLOTS * TIMER_SLOTS)
+
+static
+void timer_link(struct client_t *self, struct client_t **list) {
+    self->timer_next = *list;
+    if (*list != NULL) {
+        (*list)->timer_prev = &self->timer_next;
+    }
+    *list = self;
+    self->timer_prev = list;
+}
+
+static
+void timer_unlink(struct client_t *self) {
+    if (self->timer_next != NULL) {
+        self->timer_next->timer_prev = self->timer_prev;
+    }
+    *(self->timer_prev) = self->timer_next;
+    self->timer_prev = NULL;
+}
+
+/** Put the client in the bucket of its deadline
+ */
+static
+void timer_insert(struct timerwheel_t *self, struct client_t *client) {
+    time_t t;
+
+    t = client->timeout;
+    if (t <= self->now) {
+        t = self->now + 1;              /* due in the next tick */
+    }
+    if (t - self->now < TIMER_SLOTS) {
+        timer_link(client, &self->slots[0][t & TIMER_MASK_]);
+    } else {
+        /* cascaded to the first level when its bucket is reached */
+        timer_link(client,
+                &self->slots[1][(t >> TIMER_SHIFT_) & TIMER_MASK_]);
+    }
+}
+
+void timer_init(struct timerwheel_t *self, time_t now) {
+    memset(self, 0, sizeof(*self));
+    self->now = now;
+}
+
+void timer_add(struct timerwheel_t *self, struct client_t *client) {
+    timer_insert(self, client);
+    ++self->count;
+}
+
+void timer_remove(struct timerwheel_t *self, struct client_t *client) {
+    if (client->timer_prev != NULL) {
+        timer_unlink(client);
+        --self->count;
+    }
+}
+
+struct client_t *timer_expire(struct timerwheel_t *self, time_t now) {
+    struct client_t *expired, *c, *tc;
+
+    expired = NULL;
+    if (now < self->now) {
+        self->now = now;                /* clock went backwards */
+    } else if (now - self->now > TIMER_RANGE_) {
+        self->now = now - TIMER_RANGE_; /* every bucket is visited anyway */
+    }
+    while (self->now < now) {
+        ++self->now;
+        if ((self->now & TIMER_MASK_) == 0) {
+            /* move the due bucket of the second level down */
+            c = self->slots[1][(self->now >> TIMER_SHIFT_) & TIMER_MASK_];
+            self->slots[1][(self->now >> TIMER_SHIFT_) & TIMER_MASK_] = NULL;
+            while (c != NULL) {
+                tc = c;
+                c = c->timer_next;
+                timer_insert(self, tc);
+            }
+        }
+        c = self->slots[0][self->now & TIMER_MASK_];
+        self->slots[0][self->now & TIMER_MASK_] = NULL;
+        while (c != NULL) {
+            tc = c;
+            c = c->timer_next;
+            if (tc->timeout > self->now) {
+                /* the client was active since it had been scheduled */
+                timer_insert(self, tc);
+            } else {
+                tc->timer_prev = NULL;
+                tc->timer_next = expired;
+                expired = tc;
+                --self->count;
+            }
+        }
+    }
+    return expired;
+}
+
+int timer_next(struct timerwheel_t *self) {
+    time_t t;
+    int i;
+
+    if (self->count == 0) {
+        return -1;
+    }
+    for (i = 1; i <= TIMER_SLOTS; ++i) {
+        if (self->slots[0][(self->now + i) & TIMER_MASK_] != NULL) {
+            return i;
+        }
+    }
+    for (i = 1; i <= TIMER_SLOTS; ++i) {
+        t = (self->now >> TIMER_SHIFT_) + i;
+        if (self->slots[1][t & TIMER_MASK_] != NULL) {
+            return (t << TIMER_SHIFT_) - self->now;
+        }
+    }
+    return TIMER_RANGE_;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
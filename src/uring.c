@@ -0,0 +1,979 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#define _GNU_SOURCE                     /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include <aranea/aranea.h>
+
+/* Each descriptor has a poll request, the descriptor and a generation
+ * are its user data. A request is changed by removing it and
+ * adding a new one (next generation), so completions of the old one are
+ * recognized and dropped, even if the descriptor has been reused.
+ * If the kernel supports them (Linux 6.0), a listening socket
+ * (POLLER_ACCEPT) has a multishot accept instead, whose descriptors are
+ * queued for uring_accept, and a connected one (POLLER_STREAM) a multishot
+ * recv: the kernel receives in the buffers of a provided ring, which are
+ * read with uring_recv, so a poll is only needed for POLLER_OUT (sendfile).
+ * uring_sendmsg sends a copy of the data, no buffer of the caller is used
+ * by a request in flight.
+ * Requests are only queued, they are submitted with the wait, in a single
+ * io_uring_enter per loop.
+ */
+
+#define URING_DATA_(op, fd, gen)    (((uint64_t)(op) << 62)                 \
+        | ((uint64_t)((gen) & URING_GEN_MASK_) << 32) | (uint32_t)(fd))
+#define URING_OP_(data)         ((unsigned int)((data) >> 62))
+#define URING_FD_(data)         ((int)((data) & 0xffffffff))
+#define URING_GEN_(data)        ((unsigned int)((data) >> 32) & URING_GEN_MASK_)
+#define URING_GEN_MASK_         0x3fffffff
+/** A send is its own user data */
+#define URING_SEND_DATA_(s)     (((uint64_t)URING_OP_SEND << 62)            \
+        | (uintptr_t)(s))
+#define URING_SEND_(data)       ((struct uring_send_t *)(uintptr_t)         \
+        ((data) & ~((uint64_t)3 << 62)))
+/** Generation of requests whose completion is ignored */
+#define URING_INTERNAL_         0
+/** Buffer group of the recv requests */
+#define URING_BGID_             0
+
+enum {
+    URING_OP_POLL,
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+};
+
+/* recv request of a connected socket */
+enum {
+    URING_RECV_NONE,            /* polled, see uring_recv */
+    URING_RECV_ACTIVE,
+    URING_RECV_CANCELING,       /* enough is received in advance */
+    URING_RECV_PAUSED,          /* added again once the buffers are read */
+    URING_RECV_ENDED,           /* end of file or error */
+};
+
+/** Send in flight, freed by its completion
+ */
+struct uring_send_t {
+    int fd;
+    char data[];                /**< Copy of the message */
+};
+
+/** Provided buffer, indexed by its id
+ */
+struct uring_buf_t {
+    int next;                   /**< Next one received on the descriptor */
+    int length;
+    int offset;                 /**< Bytes already read */
+};
+
+struct uring_fd_t {
+    void *data;                 /**< NULL if not registered */
+    unsigned int events;        /**< POLLER_* of the poll request */
+    unsigned int gen;           /**< Of the poll request */
+    unsigned int stamp;         /**< Last wait reporting it */
+    int index;                  /**< in the events of that wait */
+    unsigned int rgen;          /**< Of the registration */
+    int polled;                 /**< The poll request is active */
+    int accept;                 /**< Multishot accept is active */
+    int recv;                   /**< URING_RECV_* */
+    int error;                  /**< Of the ended recv, 0 on end of file */
+    int head;                   /**< Received buffers, -1 if none */
+    int tail;
+    int pending;                /**< Number of received buffers */
+    struct uring_send_t *send;  /**< In flight */
+    int sent;                   /**< Result of the completed send */
+    int done;                   /**< Not given to uring_sendmsg yet */
+};
+
+struct uring_t {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit;     /**< Queued SQEs */
+    unsigned int stamp;
+    struct uring_fd_t *fds;     /**< Indexed by descriptor */
+    int num_fds;
+    int ops;                    /**< Accept, recv and send are supported */
+    struct io_uring_buf_ring *br;
+    char *buffers;              /**< URING_BUFFERS of URING_BUFFER_LENGTH */
+    struct uring_buf_t *bufs;
+    unsigned short br_tail;
+    int held;                   /**< Buffers received and not read */
+    int starved;                /**< A recv ended for lack of buffers */
+    int accepted[2 * URING_ENTRIES];
+    unsigned int acc_head;
+    unsigned int acc_tail;
+};
+
+static
+int uring_enter(struct uring_t *self, unsigned int to_submit,
+        unsigned int min_complete, unsigned int flags, void *arg) {
+    int ret;
+
+    ret = syscall(SYS_io_uring_enter, self->fd, to_submit, min_complete,
+            flags, arg, sizeof(struct io_uring_getevents_arg));
+    if (ret >= 0 && to_submit > 0) {
+        self->to_submit -= ret;         /* consumed SQEs */
+    }
+    return ret;
+}
+
+/** Get a free SQE, queued ones are submitted first if the ring is full.
+ */
+static
+struct io_uring_sqe *uring_get_sqe(struct uring_t *self) {
+    struct io_uring_sqe *sqe;
+    unsigned int tail, idx;
+
+    tail = *self->sq_tail;
+    if (tail - __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE)
+            >= self->sq_entries) {
+        if (uring_enter(self, self->to_submit, 0, 0, NULL) < 0) {
+            A_ERR("io_uring_enter: %s", strerror(errno));
+            return NULL;
+        }
+    }
+    idx = tail & *self->sq_mask;
+    sqe = &self->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    self->sq_array[idx] = idx;
+    __atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++self->to_submit;
+    return sqe;
+}
+
+static
+int uring_poll_add(struct uring_t *self, int fd, unsigned int events,
+        uint64_t data) {
+    struct io_uring_sqe *sqe;
+    unsigned int mask = 0;
+
+    sqe = uring_get_sqe(self);
+    if (sqe == NULL) {
+        return -1;
+    }
+    if (events & POLLER_IN) {
+        mask |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events & POLLER_OUT) {
+        mask |= EPOLLOUT;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    /* a multishot poll is edge triggered. Level triggered is a one shot
+     * poll added again after each event (see uring_wait), it completes
+     * right away if the descriptor is still ready */
+    if (events & POLLER_ET) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+    sqe->user_data = data;
+    return 0;
+}
+
+/** Cancel a request. Polls are removed with it too: POLL_REMOVE fails
+ * (EALREADY) and leaves a multishot poll armed while it is triggered.
+ */
+static
+int uring_cancel(struct uring_t *self, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(self);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = URING_DATA_(URING_OP_POLL, 0, URING_INTERNAL_);
+    return 0;
+}
+
+static
+int uring_accept_add(struct uring_t *self, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(self);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = data;
+    return 0;
+}
+
+/** Receive until the end of file, each completion has a buffer of the
+ * provided ring.
+ */
+static
+int uring_recv_add(struct uring_t *self, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(self);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID_;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+/** Give a buffer back to the kernel
+ */
+static
+void uring_buffer_put(struct uring_t *self, int bid) {
+    struct io_uring_buf *buf;
+
+    buf = &self->br->bufs[self->br_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(self->buffers
+            + (size_t)bid * URING_BUFFER_LENGTH);
+    buf->len = URING_BUFFER_LENGTH;
+    buf->bid = bid;
+    ++self->br_tail;
+    __atomic_store_n(&self->br->tail, self->br_tail, __ATOMIC_RELEASE);
+}
+
+/** Add the recv request again once the received buffers are read.
+ */
+static
+void uring_recv_resume(struct uring_t *self, int fd, struct uring_fd_t *fds) {
+    if (fds->recv != URING_RECV_PAUSED || fds->pending > 0
+            || self->held >= URING_BUFFERS) {
+        return;
+    }
+    if (uring_recv_add(self, fd, URING_DATA_(URING_OP_RECV, fd, fds->rgen))
+            == 0) {
+        fds->recv = URING_RECV_ACTIVE;
+    }
+}
+
+/** Poll a connected socket for POLLER_OUT, unless a send is in flight:
+ * its completion is the event then.
+ */
+static
+int uring_stream_poll(struct uring_t *self, int fd, struct uring_fd_t *fds) {
+    int want;
+
+    want = (fds->events & POLLER_OUT) && fds->send == NULL;
+    if (want == fds->polled) {
+        return 0;
+    }
+    if (fds->polled) {
+        fds->polled = 0;
+        return uring_cancel(self,
+                URING_DATA_(URING_OP_POLL, fd, fds->gen));
+    }
+    if (++fds->gen == URING_INTERNAL_) {
+        ++fds->gen;
+    }
+    if (uring_poll_add(self, fd, fds->events,
+                URING_DATA_(URING_OP_POLL, fd, fds->gen)) != 0) {
+        return -1;
+    }
+    fds->polled = 1;
+    return 0;
+}
+
+/** Check that multishot polls are supported (Linux 5.13): one is added
+ * on an eventfd and removed, the removal only succeeds if it was accepted.
+ */
+static
+int uring_probe(struct uring_t *self) {
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int efd, ret;
+
+    efd = eventfd(0, EFD_CLOEXEC);
+    if (efd == -1) {
+        return -1;
+    }
+    ret = -1;
+    if (uring_poll_add(self, efd, POLLER_IN | POLLER_ET,
+                URING_DATA_(URING_OP_POLL, efd, URING_INTERNAL_)) == 0
+            && uring_cancel(self,
+                URING_DATA_(URING_OP_POLL, efd, URING_INTERNAL_)) == 0
+            && uring_enter(self, self->to_submit, 2,
+                IORING_ENTER_GETEVENTS, NULL) >= 0) {
+        head = *self->cq_head;
+        for (; head != __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+                ++head) {
+            cqe = &self->cqes[head & *self->cq_mask];
+            if (cqe->user_data
+                    == URING_DATA_(URING_OP_POLL, 0, URING_INTERNAL_)
+                    && cqe->res == 0) {
+                ret = 0;
+            }
+        }
+        __atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(efd);
+    return ret;
+}
+
+/** Check that multishot recv is supported (Linux 6.0, with multishot
+ * accept): one is added on a socket pair holding a byte and closed, the
+ * byte must come in a provided buffer and the request go on.
+ */
+static
+int uring_probe_recv(struct uring_t *self) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int sv[2], ret;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -1;
+    }
+    ret = -1;
+    if (write(sv[1], "", 1) != 1) {
+        goto end;
+    }
+    close(sv[1]);
+    sv[1] = -1;
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec = 1;
+    ts.tv_nsec = 0;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    /* the byte then the end of file */
+    if (uring_recv_add(self, sv[0],
+                URING_DATA_(URING_OP_RECV, sv[0], URING_INTERNAL_)) != 0
+            || uring_enter(self, self->to_submit, 2,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg) < 0) {
+        goto end;
+    }
+    head = *self->cq_head;
+    for (; head != __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE); ++head) {
+        cqe = &self->cqes[head & *self->cq_mask];
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE)) {
+                ret = 0;
+            }
+            uring_buffer_put(self, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+    }
+    __atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+end:
+    close(sv[0]);
+    if (sv[1] != -1) {
+        close(sv[1]);
+    }
+    return ret;
+}
+
+/** Register the ring of buffers for recv and check that accept, recv and
+ * send can be used.
+ */
+static
+int uring_ops_init(struct uring_t *self) {
+    struct io_uring_buf_reg reg;
+    int i;
+
+    self->br = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (self->br == MAP_FAILED) {
+        self->br = NULL;
+        return -1;
+    }
+    self->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_LENGTH);
+    self->bufs = malloc(URING_BUFFERS * sizeof(struct uring_buf_t));
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)self->br;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID_;
+    if (self->buffers == NULL || self->bufs == NULL
+            || syscall(SYS_io_uring_register, self->fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        goto err;
+    }
+    for (i = 0; i < URING_BUFFERS; ++i) {
+        uring_buffer_put(self, i);
+    }
+    if (uring_probe_recv(self) != 0) {
+        syscall(SYS_io_uring_register, self->fd,
+                IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        goto err;
+    }
+    self->ops = 1;
+    return 0;
+err:
+    free(self->buffers);
+    free(self->bufs);
+    munmap(self->br, URING_BUFFERS * sizeof(struct io_uring_buf));
+    self->buffers = NULL;
+    self->bufs = NULL;
+    self->br = NULL;
+    return -1;
+}
+
+struct uring_t *uring_init() {
+    struct io_uring_params p;
+    struct uring_t *self;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    self = calloc(1, sizeof(struct uring_t));
+    if (self == NULL) {
+        A_ERR("Out of memory: %s", "uring_t");
+        return NULL;
+    }
+    self->fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+    if (self->fd == -1) {
+        A_LOG("io_uring_setup: %s", strerror(errno));
+        free(self);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+            || !(p.features & IORING_FEAT_EXT_ARG)) {
+        goto err;
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        A_ERR("mmap: %s", strerror(errno));
+        goto err;
+    }
+    cq = sq;
+    self->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->fd,
+            IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED) {
+        A_ERR("mmap: %s", strerror(errno));
+        munmap(sq, sq_size);
+        goto err;
+    }
+    self->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    self->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    self->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    self->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    self->sq_entries = p.sq_entries;
+    self->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    self->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    self->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    self->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    if (uring_probe(self) != 0) {
+        A_LOG("io_uring: %s", "no multishot poll");
+        munmap(self->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        munmap(sq, sq_size);
+        goto err;
+    }
+    /* polls only on older kernels */
+    if (uring_ops_init(self) != 0) {
+        A_LOG("io_uring: %s", "no multishot recv");
+    }
+    return self;
+err:
+    close(self->fd);
+    free(self);
+    return NULL;
+}
+
+void uring_close(struct uring_t *self) {
+    /* memory is left untouched, it may be shared with a vfork parent */
+    close(self->fd);
+}
+
+int uring_add(struct uring_t *self, int fd, unsigned int events,
+        void *data) {
+    struct uring_fd_t *fds;
+    int num;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fd >= self->num_fds) {
+        num = (self->num_fds > 0) ? self->num_fds : 64;
+        while (num <= fd) {
+            num *= 2;
+        }
+        fds = realloc(self->fds, num * sizeof(struct uring_fd_t));
+        if (fds == NULL) {
+            A_ERR("Out of memory: %s", "uring_fd_t");
+            return -1;
+        }
+        memset(fds + self->num_fds, 0,
+                (num - self->num_fds) * sizeof(struct uring_fd_t));
+        self->fds = fds;
+        self->num_fds = num;
+    }
+    fds = &self->fds[fd];
+    if (++fds->gen == URING_INTERNAL_) {
+        ++fds->gen;
+    }
+    fds->rgen = fds->gen;
+    fds->polled = 0;
+    fds->accept = 0;
+    fds->recv = URING_RECV_NONE;
+    fds->head = fds->tail = -1;
+    fds->pending = 0;
+    fds->send = NULL;
+    fds->done = 0;
+    if (self->ops && (events & POLLER_ACCEPT)) {
+        if (uring_accept_add(self, fd,
+                    URING_DATA_(URING_OP_ACCEPT, fd, fds->rgen)) != 0) {
+            return -1;
+        }
+        fds->accept = 1;
+    } else if (self->ops && (events & POLLER_STREAM)) {
+        if (uring_recv_add(self, fd,
+                    URING_DATA_(URING_OP_RECV, fd, fds->rgen)) != 0) {
+            return -1;
+        }
+        fds->recv = URING_RECV_ACTIVE;
+        fds->events = events & ~POLLER_IN;
+        fds->data = data;
+        if (uring_stream_poll(self, fd, fds) != 0) {
+            uring_del(self, fd);
+            return -1;
+        }
+        return 0;
+    } else {
+        if (uring_poll_add(self, fd, events,
+                    URING_DATA_(URING_OP_POLL, fd, fds->gen)) != 0) {
+            return -1;
+        }
+        fds->polled = 1;
+    }
+    fds->data = data;
+    fds->events = events;
+    return 0;
+}
+
+int uring_del(struct uring_t *self, int fd) {
+    struct uring_fd_t *fds;
+    int ret = 0;
+
+    if (fd < 0 || fd >= self->num_fds || self->fds[fd].data == NULL) {
+        return -1;
+    }
+    fds = &self->fds[fd];
+    fds->data = NULL;
+    if (fds->polled) {
+        ret |= uring_cancel(self,
+                URING_DATA_(URING_OP_POLL, fd, fds->gen));
+    }
+    if (fds->accept) {
+        ret |= uring_cancel(self, URING_DATA_(URING_OP_ACCEPT, fd, fds->rgen));
+    }
+    if (fds->recv == URING_RECV_ACTIVE) {
+        ret |= uring_cancel(self, URING_DATA_(URING_OP_RECV, fd, fds->rgen));
+    }
+    /* the closed socket is held until its requests end */
+    if (fds->send != NULL) {
+        ret |= uring_cancel(self, URING_SEND_DATA_(fds->send));
+        fds->send = NULL;
+    }
+    while (fds->head != -1) {
+        uring_buffer_put(self, fds->head);
+        fds->head = self->bufs[fds->head].next;
+    }
+    self->held -= fds->pending;
+    fds->pending = 0;
+    return ret;
+}
+
+int uring_mod(struct uring_t *self, int fd, unsigned int events,
+        void *data) {
+    struct uring_fd_t *fds;
+
+    if (fd < 0 || fd >= self->num_fds || self->fds[fd].data == NULL) {
+        return -1;
+    }
+    fds = &self->fds[fd];
+    if (fds->recv == URING_RECV_NONE) {
+        if (uring_del(self, fd) != 0) {
+            return -1;
+        }
+        return uring_add(self, fd, events, data);
+    }
+    /* POLLER_IN comes with the recv request */
+    fds->data = data;
+    fds->events = events & ~POLLER_IN;
+    return uring_stream_poll(self, fd, fds);
+}
+
+int uring_accept(struct uring_t *self, int fd, struct sockaddr *addr,
+        socklen_t *len) {
+    int cfd;
+
+    if (fd < 0 || fd >= self->num_fds || !self->fds[fd].accept) {
+        return accept4(fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    }
+    while (self->acc_head != self->acc_tail) {
+        cfd = self->accepted[self->acc_head++ % A_SIZEOF(self->accepted)];
+        if (getpeername(cfd, addr, len) == 0) {
+            return cfd;
+        }
+        close(cfd);                     /* already reset */
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t uring_recv(struct uring_t *self, int fd, void *buf, size_t len) {
+    struct uring_fd_t *fds;
+    struct uring_buf_t *b;
+    size_t n, k;
+    int bid;
+
+    if (fd < 0 || fd >= self->num_fds
+            || self->fds[fd].recv == URING_RECV_NONE) {
+        return recv(fd, buf, len, 0);
+    }
+    fds = &self->fds[fd];
+    for (n = 0; fds->head != -1 && n < len; n += k) {
+        bid = fds->head;
+        b = &self->bufs[bid];
+        k = b->length - b->offset;
+        if (k > len - n) {
+            k = len - n;
+        }
+        memcpy((char *)buf + n, self->buffers
+                + (size_t)bid * URING_BUFFER_LENGTH + b->offset, k);
+        b->offset += k;
+        if (b->offset == b->length) {
+            fds->head = b->next;
+            if (fds->head == -1) {
+                fds->tail = -1;
+            }
+            --fds->pending;
+            --self->held;
+            uring_buffer_put(self, bid);
+        }
+    }
+    uring_recv_resume(self, fd, fds);
+    if (n > 0) {
+        return n;
+    }
+    if (fds->recv == URING_RECV_ENDED) {
+        if (fds->error == 0) {
+            return 0;
+        }
+        errno = fds->error;
+        return -1;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t uring_sendmsg(struct uring_t *self, int fd, const struct msghdr *msg,
+        int flags) {
+    struct io_uring_sqe *sqe;
+    struct uring_send_t *s;
+    struct uring_fd_t *fds;
+    size_t len, n, k;
+    size_t i;
+
+    if (fd < 0 || fd >= self->num_fds
+            || self->fds[fd].recv == URING_RECV_NONE) {
+        return sendmsg(fd, msg, flags);
+    }
+    fds = &self->fds[fd];
+    if (fds->send != NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (fds->done) {
+        fds->done = 0;
+        if (fds->sent < 0) {
+            errno = -fds->sent;
+            return -1;
+        }
+        return fds->sent;
+    }
+    len = 0;
+    for (i = 0; i < msg->msg_iovlen; ++i) {
+        len += msg->msg_iov[i].iov_len;
+    }
+    if (len > URING_SEND_LENGTH) {
+        len = URING_SEND_LENGTH;        /* the rest is sent afterwards */
+    }
+    s = malloc(sizeof(struct uring_send_t) + len);
+    if (s == NULL) {
+        A_ERR("Out of memory: %s", "uring_send_t");
+        errno = ENOMEM;
+        return -1;
+    }
+    for (n = 0, i = 0; n < len; ++i) {
+        k = msg->msg_iov[i].iov_len;
+        if (k > len - n) {
+            k = len - n;
+        }
+        memcpy(s->data + n, msg->msg_iov[i].iov_base, k);
+        n += k;
+    }
+    sqe = uring_get_sqe(self);
+    if (sqe == NULL) {
+        free(s);
+        errno = EIO;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)s->data;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    sqe->user_data = URING_SEND_DATA_(s);
+    s->fd = fd;
+    fds->send = s;
+    uring_stream_poll(self, fd, fds);
+    /* the result is given to the same call after the POLLER_OUT event */
+    errno = EAGAIN;
+    return -1;
+}
+
+static
+unsigned int uring_complete_poll(struct uring_t *self, int fd,
+        struct uring_fd_t *fds, struct io_uring_cqe *cqe) {
+    unsigned int ev = 0;
+
+    if (fds->data == NULL || !fds->polled
+            || fds->gen != URING_GEN_(cqe->user_data)) {
+        return 0;                       /* removed request */
+    }
+    /* errors are reported to both directions so the handler finds out */
+    if (cqe->res < 0) {
+        ev = POLLER_IN | POLLER_OUT;
+    } else {
+        if (cqe->res & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            ev |= POLLER_IN;
+        }
+        if (cqe->res & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            ev |= POLLER_OUT;
+        }
+    }
+    /* one shot request, or the kernel ended a multishot one */
+    if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0) {
+        uring_poll_add(self, fd, fds->events, cqe->user_data);
+    }
+    return ev;
+}
+
+static
+unsigned int uring_complete_accept(struct uring_t *self, int fd,
+        struct uring_fd_t *fds, struct io_uring_cqe *cqe) {
+    if (fds->data == NULL || fds->rgen != URING_GEN_(cqe->user_data)) {
+        if (cqe->res >= 0) {
+            close(cqe->res);
+        }
+        return 0;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_accept_add(self, fd, cqe->user_data);
+    }
+    if (cqe->res < 0) {
+        A_ERR("accept: %s", strerror(-cqe->res));
+        return 0;
+    }
+    if (self->acc_tail - self->acc_head >= A_SIZEOF(self->accepted)) {
+        A_ERR("accept: %s", "too many connections at once");
+        close(cqe->res);
+        return POLLER_IN;
+    }
+    self->accepted[self->acc_tail++ % A_SIZEOF(self->accepted)] = cqe->res;
+    return POLLER_IN;
+}
+
+static
+unsigned int uring_complete_recv(struct uring_t *self, int fd,
+        struct uring_fd_t *fds, struct io_uring_cqe *cqe) {
+    struct uring_buf_t *b;
+    int bid = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    if (fds->data == NULL || fds->rgen != URING_GEN_(cqe->user_data)) {
+        if (bid != -1) {
+            uring_buffer_put(self, bid);
+        }
+        return 0;
+    }
+    if (bid != -1) {
+        b = &self->bufs[bid];
+        b->next = -1;
+        b->length = cqe->res;
+        b->offset = 0;
+        if (fds->tail == -1) {
+            fds->head = bid;
+        } else {
+            self->bufs[fds->tail].next = bid;
+        }
+        fds->tail = bid;
+        ++fds->pending;
+        ++self->held;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            fds->recv = URING_RECV_PAUSED;
+        } else if (fds->recv == URING_RECV_ACTIVE
+                && fds->pending >= URING_BUFFERS_PER_FD) {
+            /* not read yet, the socket holds the rest */
+            if (uring_cancel(self, cqe->user_data) == 0) {
+                fds->recv = URING_RECV_CANCELING;
+            }
+        }
+        return POLLER_IN;
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return 0;
+    }
+    if (cqe->res == -ENOBUFS) {
+        fds->recv = URING_RECV_PAUSED;
+        self->starved = 1;
+        return 0;
+    }
+    if (cqe->res == -ECANCELED) {
+        fds->recv = URING_RECV_PAUSED;
+        uring_recv_resume(self, fd, fds);
+        return 0;
+    }
+    fds->recv = URING_RECV_ENDED;
+    fds->error = -cqe->res;
+    return POLLER_IN;
+}
+
+static
+unsigned int uring_complete_send(struct uring_t *self, int fd,
+        struct uring_fd_t *fds, struct io_uring_cqe *cqe) {
+    struct uring_send_t *s;
+    unsigned int ev = 0;
+
+    s = URING_SEND_(cqe->user_data);
+    if (fds->data != NULL && fds->send == s) {
+        fds->send = NULL;
+        fds->sent = cqe->res;
+        fds->done = 1;
+        uring_stream_poll(self, fd, fds);
+        ev = POLLER_OUT;
+    }
+    free(s);
+    return ev;
+}
+
+int uring_wait(struct uring_t *self, struct poller_event_t *events,
+        int max, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    struct uring_fd_t *fds;
+    unsigned int head, tail, ev;
+    int num, fd;
+
+    head = *self->cq_head;
+    if (head == __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE)) {
+        memset(&arg, 0, sizeof(arg));
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000L;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        /* submit the queued requests and wait, in one call */
+        if (uring_enter(self, self->to_submit, 1,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg) < 0) {
+            if (errno == ETIME) {
+                return 0;
+            }
+            if (errno != EBUSY) {
+                return -1;
+            }
+        }
+    } else if (self->to_submit > 0) {
+        if (uring_enter(self, self->to_submit, 0, 0, NULL) < 0
+                && errno != EBUSY) {
+            return -1;
+        }
+    }
+    /* one event per descriptor, as epoll does */
+    ++self->stamp;
+    num = 0;
+    tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        cqe = &self->cqes[head & *self->cq_mask];
+        if (URING_OP_(cqe->user_data) == URING_OP_SEND) {
+            fd = URING_SEND_(cqe->user_data)->fd;
+        } else if (URING_GEN_(cqe->user_data) == URING_INTERNAL_) {
+            continue;
+        } else {
+            fd = URING_FD_(cqe->user_data);
+        }
+        fds = &self->fds[fd];
+        if (fds->data != NULL && fds->stamp != self->stamp && num == max) {
+            break;                      /* left for the next call */
+        }
+        switch (URING_OP_(cqe->user_data)) {
+        case URING_OP_POLL:
+            ev = uring_complete_poll(self, fd, fds, cqe);
+            break;
+        case URING_OP_ACCEPT:
+            ev = uring_complete_accept(self, fd, fds, cqe);
+            break;
+        case URING_OP_RECV:
+            ev = uring_complete_recv(self, fd, fds, cqe);
+            break;
+        default:
+            ev = uring_complete_send(self, fd, fds, cqe);
+            break;
+        }
+        if (ev == 0) {
+            continue;
+        }
+        if (fds->stamp == self->stamp) {
+            events[fds->index].events |= ev;
+        } else {
+            fds->stamp = self->stamp;
+            fds->index = num;
+            events[num].data = fds->data;
+            events[num].events = ev;
+            ++num;
+        }
+    }
+    __atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+    /* buffers are back, recv requests which ran out of them go on */
+    if (self->starved && self->held < URING_BUFFERS) {
+        self->starved = 0;
+        for (fd = 0; fd < self->num_fds; ++fd) {
+            if (self->fds[fd].data != NULL) {
+                uring_recv_resume(self, fd, &self->fds[fd]);
+            }
+        }
+    }
+    return num;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,216 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#define _GNU_SOURCE                     /* sched_setaffinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+
+#include <aranea/aranea.h>
+
+struct worker_t {
+    pid_t pid;
+    int fd;             /**< Listening socket, kept to not lose its queue */
+    time_t started;
+};
+
+static struct worker_t workers_[MAX_WORKERS];
+static int num_workers_ = 0;
+
+/** Forward the signal to all workers. The supervisor stops when there is
+ * no more children.
+ */
+static
+void worker_handle_signal(int sig) {
+    int i;
+
+    for (i = 0; i < num_workers_; ++i) {
+        if (workers_[i].pid > 0) {
+            kill(workers_[i].pid, sig);
+        }
+    }
+}
+
+static
+void worker_pin(int id) {
+    long ncpu;
+    cpu_set_t set;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 1) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(id % ncpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        A_ERR("sched_setaffinity: %s", strerror(errno));
+    }
+}
+
+/** Ask the kernel to deliver connections handled by the worker's CPU to its
+ * socket.
+ */
+static
+void worker_steer(int id, int fd) {
+#ifdef SO_INCOMING_CPU
+    long ncpu;
+    int cpu;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 1) {
+        return;
+    }
+    cpu = id % ncpu;
+    if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+        A_ERR("setsockopt: SO_INCOMING_CPU %s", strerror(errno));
+    }
+#else
+    (void)id;
+    (void)fd;
+#endif
+}
+
+/** Fork a worker.
+ * @return 0 in the child, -1 on error, pid otherwise.
+ */
+static
+pid_t worker_fork(struct server_t *server, int id) {
+    struct sigaction sa;
+    pid_t pid, ppid;
+    int i;
+
+    ppid = getpid();
+    pid = fork();
+    if (pid < 0) {
+        A_ERR("fork: %s", strerror(errno));
+        return -1;
+    }
+    if (pid > 0) {
+        workers_[id].pid = pid;
+        workers_[id].started = time(NULL);
+        A_LOG("worker %d started %d", id, pid);
+        return pid;
+    }
+    /* child: handlers are set up again by the main program */
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGQUIT, &sa, NULL);
+    /* quit with the supervisor */
+    prctl(PR_SET_PDEATHSIG, SIGQUIT);
+    if (getppid() != ppid) {
+        _exit(1);               /* it died before prctl */
+    }
+
+    for (i = 0; i < num_workers_; ++i) {
+        if (i != id) {
+            close(workers_[i].fd);
+        }
+    }
+    server->fd = workers_[id].fd;
+    worker_pin(id);
+    num_workers_ = 0;
+    return 0;
+}
+
+/** Wait for the workers and respawn them if they crash
+ * @return 1 in a respawned worker, 0 when no workers left.
+ */
+static
+int worker_supervise(struct server_t *server) {
+    pid_t pid;
+    int status, i;
+
+    for (;;) {
+        pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;                          /* ECHILD */
+        }
+        for (i = 0; i < num_workers_; ++i) {
+            if (workers_[i].pid == pid) {
+                break;
+            }
+        }
+        if (i >= num_workers_) {
+            continue;
+        }
+        workers_[i].pid = -1;
+        if (!WIFSIGNALED(status) || WTERMSIG(status) == SIGQUIT) {
+            A_LOG("worker %d exited %d", i, status);
+            continue;
+        }
+        A_ERR("worker %d killed by signal %d, respawn", i, WTERMSIG(status));
+        /* do not spin if it crashes immediately */
+        if (time(NULL) - workers_[i].started < 1) {
+            sleep(1);
+        }
+        if (worker_fork(server, i) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int worker_run(struct server_t *server, int num) {
+    struct sigaction sa;
+    pid_t pid;
+    int i;
+
+    if (num > MAX_WORKERS) {
+        num = MAX_WORKERS;
+    }
+    for (i = 0; i < num; ++i) {
+        workers_[i].pid = -1;
+        workers_[i].fd = server_listen(server, 1);
+        if (workers_[i].fd == -1) {
+            goto err;
+        }
+        ++num_workers_;
+        worker_steer(i, workers_[i].fd);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = &worker_handle_signal;
+    if (sigaction(SIGQUIT, &sa, NULL) < 0) {
+        A_ERR("sigaction %s", strerror(errno));
+        goto err;
+    }
+    for (i = 0; i < num; ++i) {
+        pid = worker_fork(server, i);
+        if (pid == 0) {
+            return 1;
+        }
+        if (pid < 0) {
+            worker_handle_signal(SIGQUIT);
+            break;
+        }
+    }
+    if (worker_supervise(server) != 0) {
+        return 1;
+    }
+    for (i = 0; i < num_workers_; ++i) {
+        close(workers_[i].fd);
+    }
+    return 0;
+
+err:
+    for (i = 0; i < num_workers_; ++i) {
+        close(workers_[i].fd);
+    }
+    return -1;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,473 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+#define _GNU_SOURCE                     /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if HAVE_ZSTD == 1
+# include <zstd.h>
+#endif
+
+#include <aranea/aranea.h>
+
+/* Entries are shared by the event loops and the threads compressing them,
+ * under lock_. A new entry is queued, then it is either ready or failed,
+ * which is remembered as well so that the file is not compressed again
+ * until it changes (the key includes mtime and size). Unreferenced entries
+ * are kept in LRU order and evicted when there is no room, in the table or
+ * in ZCACHE_MEMORY.
+ */
+static struct zcache_t entries_[ZCACHE_SIZE];
+static int used_ = 0;
+static struct zcache_t *free_ = NULL;
+static struct zcache_t *idle_head_ = NULL;
+static struct zcache_t *idle_tail_ = NULL;
+static struct zcache_t *buckets_[ZCACHE_BUCKETS];
+static size_t memory_ = 0;
+static struct zcache_t *head_ = NULL;   /* queue */
+static struct zcache_t *tail_ = NULL;
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads_ = NULL;
+static int num_threads_ = 0;
+static int quit_ = 0;
+
+/** FNV-1a, the encoding is a part of the key */
+static
+unsigned int zcache_hash(const char *path, unsigned int encoding) {
+    unsigned int h = 2166136261u ^ encoding;
+
+    while (*path != '\0') {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+        ++path;
+    }
+    return h;
+}
+
+static
+void zcache_link_idle(struct zcache_t *self) {
+    self->prev = NULL;
+    self->next = idle_head_;
+    if (idle_head_ != NULL) {
+        idle_head_->prev = self;
+    } else {
+        idle_tail_ = self;
+    }
+    idle_head_ = self;
+}
+
+static
+void zcache_unlink_idle(struct zcache_t *self) {
+    if (self->prev != NULL) {
+        self->prev->next = self->next;
+    } else {
+        idle_head_ = self->next;
+    }
+    if (self->next != NULL) {
+        self->next->prev = self->prev;
+    } else {
+        idle_tail_ = self->prev;
+    }
+    self->next = self->prev = NULL;
+}
+
+/** Remove an idle entry from the table and put it in the free list.
+ */
+static
+void zcache_drop(struct zcache_t *self) {
+    struct zcache_t **p;
+
+    for (p = &buckets_[self->hash % ZCACHE_BUCKETS]; *p != NULL;
+            p = &(*p)->hnext) {
+        if (*p == self) {
+            *p = self->hnext;
+            break;
+        }
+    }
+    zcache_unlink_idle(self);
+    if (self->fd != -1) {
+        close(self->fd);
+        self->fd = -1;
+        memory_ -= self->length;
+    }
+    self->state = ZCACHE_FREE;
+    self->hnext = NULL;
+    self->next = free_;
+    free_ = self;
+}
+
+/** Write all of data.
+ * @return -1 on error.
+ */
+static
+int zcache_write(int fd, const char *data, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** Compress src into dst with gzip. in and out are ZCACHE_CHUNK long.
+ * @return compressed length, -1 on error.
+ */
+static
+off_t zcache_gzip(int src, int dst, char *in, char *out) {
+    z_stream zs;
+    ssize_t n;
+    off_t len;
+    int ret, flush;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16: gzip header and trailer rather than zlib ones */
+    if (deflateInit2(&zs, ZCACHE_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    len = 0;
+    do {
+        n = read(src, in, ZCACHE_CHUNK);
+        if (n < 0) {
+            len = -1;
+            break;
+        }
+        flush = (n == 0) ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = (Bytef *)out;
+            zs.avail_out = ZCACHE_CHUNK;
+            ret = deflate(&zs, flush);
+            n = ZCACHE_CHUNK - zs.avail_out;
+            if (ret == Z_STREAM_ERROR || zcache_write(dst, out, n) != 0) {
+                len = -1;
+                break;
+            }
+            len += n;
+        } while (zs.avail_out == 0);
+    } while (len >= 0 && flush != Z_FINISH);
+    deflateEnd(&zs);
+    return len;
+}
+
+#if HAVE_ZSTD == 1
+/** Compress src into dst with zstd. in and out are ZCACHE_CHUNK long.
+ * @return compressed length, -1 on error.
+ */
+static
+off_t zcache_zstd(int src, int dst, char *in, char *out) {
+    ZSTD_CCtx *cctx;
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    ZSTD_EndDirective mode;
+    size_t rest;
+    ssize_t n;
+    off_t len;
+
+    cctx = ZSTD_createCCtx();
+    if (cctx == NULL) {
+        return -1;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZCACHE_ZSTD_LEVEL);
+    len = 0;
+    do {
+        n = read(src, in, ZCACHE_CHUNK);
+        if (n < 0) {
+            len = -1;
+            break;
+        }
+        mode = (n == 0) ? ZSTD_e_end : ZSTD_e_continue;
+        zin.src = in;
+        zin.size = n;
+        zin.pos = 0;
+        do {
+            zout.dst = out;
+            zout.size = ZCACHE_CHUNK;
+            zout.pos = 0;
+            rest = ZSTD_compressStream2(cctx, &zout, &zin, mode);
+            if (ZSTD_isError(rest)
+                    || zcache_write(dst, out, zout.pos) != 0) {
+                len = -1;
+                break;
+            }
+            len += zout.pos;
+        } while (mode == ZSTD_e_end ? rest != 0 : zin.pos < zin.size);
+    } while (len >= 0 && mode != ZSTD_e_end);
+    ZSTD_freeCCtx(cctx);
+    return len;
+}
+#endif
+
+/** Compress the file of the entry into a memfd, outside of the lock.
+ * @return -1 if it failed or is not worth it.
+ */
+static
+int zcache_compress(struct zcache_t *self, char *in, char *out) {
+    struct stat st;
+    off_t len;
+    int src, dst;
+
+    src = client_open_path(self->path, &st);
+    if (src == -1) {
+        return -1;
+    }
+    if (st.st_mtime != self->mtime || st.st_size != self->size) {
+        close(src);
+        return -1;                      /* changed since, a new key */
+    }
+    dst = memfd_create("aranea-zcache", MFD_CLOEXEC);
+    if (dst == -1) {
+        A_ERR("memfd_create: %s", strerror(errno));
+        close(src);
+        return -1;
+    }
+#if HAVE_ZSTD == 1
+    if (self->encoding == ENCODING_ZSTD) {
+        len = zcache_zstd(src, dst, in, out);
+    } else
+#endif
+    len = zcache_gzip(src, dst, in, out);
+    close(src);
+    if (len < 0 || len >= self->size) {
+        close(dst);
+        return -1;
+    }
+    self->fd = dst;
+    self->length = len;
+    return 0;
+}
+
+/** Account the compressed content, least recently used ones are evicted
+ * to stay within the budget.
+ * @return -1 if it does not fit.
+ */
+static
+int zcache_reserve(off_t len) {
+    struct zcache_t *e, *prev;
+
+    for (e = idle_tail_; e != NULL
+            && memory_ + len > ZCACHE_MEMORY; e = prev) {
+        prev = e->prev;
+        if (e->fd != -1) {
+            zcache_drop(e);
+        }
+    }
+    if (memory_ + len > ZCACHE_MEMORY) {
+        return -1;
+    }
+    memory_ += len;
+    return 0;
+}
+
+static
+void *zcache_main(void *A_UNUSED(arg)) {
+    struct zcache_t *e;
+    char *buf;
+    int ret;
+
+    buf = malloc(ZCACHE_CHUNK * 2);
+    if (buf == NULL) {
+        A_ERR("Out of memory: %s", "zcache");
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&lock_);
+        while (!quit_ && head_ == NULL) {
+            pthread_cond_wait(&cond_, &lock_);
+        }
+        if (quit_) {
+            pthread_mutex_unlock(&lock_);
+            break;
+        }
+        e = head_;
+        head_ = e->next;
+        if (head_ == NULL) {
+            tail_ = NULL;
+        }
+        pthread_mutex_unlock(&lock_);
+
+        ret = zcache_compress(e, buf, buf + ZCACHE_CHUNK);
+        A_LOG("zcache: %s %ld -> %ld", e->path, (long)e->size,
+                (ret == 0) ? (long)e->length : -1L);
+
+        pthread_mutex_lock(&lock_);
+        if (ret == 0 && zcache_reserve(e->length) != 0) {
+            close(e->fd);
+            e->fd = -1;
+            ret = -1;
+        }
+        e->state = (ret == 0) ? ZCACHE_READY : ZCACHE_FAILED;
+        zcache_link_idle(e);            /* no client yet */
+        pthread_mutex_unlock(&lock_);
+    }
+    free(buf);
+    return NULL;
+}
+
+int zcache_init(int num) {
+    sigset_t set, old;
+    int i, ret;
+
+    threads_ = calloc(num, sizeof(pthread_t));
+    if (threads_ == NULL) {
+        A_ERR("Out of memory: %s", "zcache");
+        return -1;
+    }
+    /* signals are handled by the main thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (i = 0; i < num; ++i) {
+        ret = pthread_create(&threads_[i], NULL, &zcache_main, NULL);
+        if (ret != 0) {
+            A_ERR("pthread_create: %s", strerror(ret));
+            break;
+        }
+        ++num_threads_;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return (num_threads_ < num) ? -1 : 0;
+}
+
+void zcache_cleanup() {
+    int i;
+
+    pthread_mutex_lock(&lock_);
+    quit_ = 1;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+    for (i = 0; i < num_threads_; ++i) {
+        pthread_join(threads_[i], NULL);
+    }
+    free(threads_);
+    threads_ = NULL;
+    num_threads_ = 0;
+    for (i = 0; i < used_; ++i) {
+        if (entries_[i].fd != -1) {
+            close(entries_[i].fd);
+            entries_[i].fd = -1;
+        }
+    }
+    used_ = 0;
+    free_ = NULL;
+    idle_head_ = idle_tail_ = NULL;
+    head_ = tail_ = NULL;
+    memory_ = 0;
+    memset(buckets_, 0, sizeof(buckets_));
+}
+
+unsigned int zcache_encodings() {
+#if HAVE_ZSTD == 1
+    return ENCODING_GZIP | ENCODING_ZSTD;
+#else
+    return ENCODING_GZIP;
+#endif
+}
+
+/** Add an entry for the file and queue it, if there is room.
+ */
+static
+void zcache_add(const char *path, unsigned int h, time_t mtime, off_t size,
+        unsigned int encoding) {
+    struct zcache_t *e;
+    size_t len;
+
+    len = strlen(path);
+    if (len >= sizeof(e->path) || num_threads_ == 0) {
+        return;
+    }
+    if (free_ == NULL) {
+        if (used_ < ZCACHE_SIZE) {
+            e = &entries_[used_];
+            ++used_;
+        } else if (idle_tail_ != NULL) {
+            zcache_drop(idle_tail_);    /* pushed to the free list */
+            e = free_;
+            free_ = e->next;
+        } else {
+            return;                     /* every entry is busy */
+        }
+    } else {
+        e = free_;
+        free_ = e->next;
+    }
+    memcpy(e->path, path, len + 1);
+    e->hash = h;
+    e->mtime = mtime;
+    e->size = size;
+    e->encoding = encoding;
+    e->state = ZCACHE_PENDING;
+    e->fd = -1;
+    e->length = 0;
+    e->refs = 0;
+    e->hnext = buckets_[h % ZCACHE_BUCKETS];
+    buckets_[h % ZCACHE_BUCKETS] = e;
+    e->prev = NULL;
+    e->next = NULL;
+    if (tail_ != NULL) {
+        tail_->next = e;
+    } else {
+        head_ = e;
+    }
+    tail_ = e;
+    pthread_cond_signal(&cond_);
+}
+
+struct zcache_t *zcache_get(const char *path, time_t mtime, off_t size,
+        unsigned int encoding) {
+    struct zcache_t *e;
+    unsigned int h;
+
+    h = zcache_hash(path, encoding);
+    pthread_mutex_lock(&lock_);
+    for (e = buckets_[h % ZCACHE_BUCKETS]; e != NULL; e = e->hnext) {
+        if (e->hash == h && e->encoding == encoding && e->mtime == mtime
+                && e->size == size && strcmp(e->path, path) == 0) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        zcache_add(path, h, mtime, size, encoding);
+    } else if (e->state == ZCACHE_READY) {
+        if (e->refs == 0) {
+            zcache_unlink_idle(e);
+        }
+        ++e->refs;
+        pthread_mutex_unlock(&lock_);
+        return e;
+    } else if (e->state == ZCACHE_FAILED) {
+        zcache_unlink_idle(e);          /* most recently used */
+        zcache_link_idle(e);
+    }
+    pthread_mutex_unlock(&lock_);
+    return NULL;
+}
+
+void zcache_release(struct zcache_t *self) {
+    pthread_mutex_lock(&lock_);
+    if (--self->refs == 0) {
+        zcache_link_idle(self);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,173 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+/* Response header benchmark (make bench-header) for the functions of
+ * http.c which render status lines and fields. The first case renders the
+ * same 200 header with snprintf() and strftime(), as http.c used to, and
+ * checks that both give the same bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <aranea/aranea.h>
+
+A_TLS time_t g_curtime;
+struct config_t g_config = {
+    .root = "/var/www",
+    .root_length = sizeof("/var/www") - 1,
+};
+A_TLS char g_buff[GBUFF_LENGTH];
+A_TLS struct server_t g_server;
+
+#define BENCH_ROUNDS            2000000
+#define BENCH_PER_SECOND        10000   /* responses before Date changes */
+
+static const unsigned int FILE_FLAGS = HTTP_FLAG_DATE | HTTP_FLAG_ACCEPT
+        | HTTP_FLAG_CONTENT | HTTP_FLAG_ENCODING | HTTP_FLAG_END;
+
+static const int STATUS_CODES[] = {
+    200, 206, 304, 400, 401, 403, 404, 413, 416, 500, 501, 503
+};
+
+/** 200 header of a file, rendered with the C library
+ */
+static
+int bench_snprintf(struct response_t *r, char *data, int sz) {
+    struct tm tm;
+    int len;
+
+    len = snprintf(data, sz, HTTP_VERSION " %d %s\r\nServer: " SERVER_ID
+            "\r\n", r->status_code, http_string_status(r->status_code));
+    len += strftime(data + len, sz - len, "Date: " DATE_FORMAT "\r\n",
+            gmtime_r(&g_curtime, &tm));
+    len += snprintf(data + len, sz - len, "Accept-Ranges: bytes\r\n"
+            "Content-Length: %ld\r\nContent-Type: %s\r\n",
+            (long)r->content_length, r->content_type);
+    len += strftime(data + len, sz - len, "Last-Modified: " DATE_FORMAT
+            "\r\n", gmtime_r(&r->last_mod, &tm));
+    len += snprintf(data + len, sz - len, "ETag: %.*s\r\n\r\n",
+            r->etag_length, r->etag);
+    return len;
+}
+
+static
+int bench_file(struct response_t *r, char *data, int sz) {
+    return http_gen_header(r, data, sz, FILE_FLAGS);
+}
+
+/** Cached file: fields rendered once (see filecache_put) */
+static
+int bench_template(struct response_t *r, char *data, int sz) {
+    static char fields[FILECACHE_HEADER_LENGTH];
+    static int length = 0;
+
+    if (length == 0) {
+        length = http_gen_fields(r, fields, sizeof(fields),
+                HTTP_FLAG_ACCEPT | HTTP_FLAG_CONTENT);
+    }
+    return http_gen_header_template(r, data, sz, HTTP_FLAG_DATE
+            | HTTP_FLAG_ENCODING | HTTP_FLAG_END, fields, length);
+}
+
+static
+int bench_range(struct response_t *r, char *data, int sz) {
+    int len;
+
+    r->status_code = HTTP_STATUS_PARTIALCONTENT;
+    len = http_gen_header(r, data, sz, FILE_FLAGS | HTTP_FLAG_RANGE);
+    r->status_code = HTTP_STATUS_OK;
+    return len;
+}
+
+static
+int bench_notmodified(struct response_t *r, char *data, int sz) {
+    int len;
+
+    r->status_code = HTTP_STATUS_NOTMODIFIED;
+    len = http_gen_header(r, data, sz, HTTP_FLAG_DATE | HTTP_FLAG_ETAG
+            | HTTP_FLAG_ENCODING | HTTP_FLAG_END);
+    r->status_code = HTTP_STATUS_OK;
+    return len;
+}
+
+static
+int bench_status(struct response_t *r, char *data, int sz) {
+    static unsigned int i = 0;
+    const char *s;
+
+    (void)r;
+    (void)sz;
+    s = http_string_status(STATUS_CODES[i++ % A_SIZEOF(STATUS_CODES)]);
+    data[0] = s[0];
+    return 1;
+}
+
+struct bench_t {
+    const char *name;
+    int (*run)(struct response_t *r, char *data, int sz);
+};
+
+static const struct bench_t BENCHES[] = {
+    { "200 snprintf", &bench_snprintf },
+    { "200 file", &bench_file },
+    { "200 cached", &bench_template },
+    { "206 range", &bench_range },
+    { "304", &bench_notmodified },
+    { "status text", &bench_status },
+};
+
+int main() {
+    char buf[1024], ref[1024];
+    struct response_t r;
+    struct stat st;
+    struct timespec start, end;
+    volatile int sink = 0;
+    double ns;
+    int i, n, len;
+
+    memset(&r, 0, sizeof(r));
+    memset(&st, 0, sizeof(st));
+    g_curtime = 1354026236;
+    st.st_ino = 1234567;
+    st.st_size = 108894;
+    st.st_mtime = g_curtime - 86400;
+    r.status_code = HTTP_STATUS_OK;
+    r.content_type = "application/javascript";
+    r.total_length = st.st_size;
+    r.content_length = 1024;
+    r.content_from = 4096;
+    r.last_mod = st.st_mtime;
+    r.etag_length = http_gen_etag(r.etag, sizeof(r.etag), &st);
+
+    /* same bytes as the C library */
+    r.content_length = st.st_size;
+    len = bench_snprintf(&r, ref, sizeof(ref));
+    if (bench_file(&r, buf, sizeof(buf)) != len
+            || memcmp(buf, ref, len) != 0
+            || bench_template(&r, buf, sizeof(buf)) != len
+            || memcmp(buf, ref, len) != 0) {
+        fprintf(stderr, "headers differ:\n%.*s\n", len, ref);
+        return 1;
+    }
+    for (i = 0; i < (int)A_SIZEOF(BENCHES); ++i) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (n = 0; n < BENCH_ROUNDS; ++n) {
+            if (n % BENCH_PER_SECOND == 0) {
+                ++g_curtime;
+            }
+            sink += BENCHES[i].run(&r, buf, sizeof(buf));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+        fprintf(stdout, "%-14s %8.1f ns/header\n", BENCHES[i].name,
+                ns / BENCH_ROUNDS);
+    }
+    return (sink == 0);
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,209 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+/* Time to first byte of small requests while large files are downloaded
+ * (make bench-latency), to tune SENDFILE_CHUNK, SENDFILE_QUOTA and the
+ * READAHEAD_* settings. With -e, the big file (its local path, the server
+ * must run on the same host) is dropped from the page cache before every
+ * download, so that it is read from the disk.
+ *
+ * Usage: ./bench-latency [-h HOST] [-p PORT] [-b BIG_PATH] [-s SMALL_PATH]
+ *                        [-c DOWNLOADS] [-n REQUESTS] [-e BIG_FILE]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+static const char *host_ = "127.0.0.1";
+static const char *port_ = "8080";
+static const char *big_ = "/big.bin";
+static const char *small_ = "/index.html";
+static const char *evict_ = NULL;
+static int quit_ = 0;
+static unsigned long long received_ = 0;
+
+static
+double now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** Connect and send a GET request
+ * @return socket, -1 if failed.
+ */
+static
+int request(const char *path) {
+    struct addrinfo hints, *res;
+    char buf[512];
+    int fd, len;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host_, port_, &hints, &res) != 0) {
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        return -1;
+    }
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", path);
+    if (send(fd, buf, len, 0) != len) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Drop the file from the page cache (cold cache)
+ */
+static
+void evict(const char *path) {
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/** Download the big file again and again
+ */
+static
+void *download(void *arg) {
+    char buf[65536];
+    ssize_t len;
+    int fd;
+
+    (void)arg;
+    while (!__atomic_load_n(&quit_, __ATOMIC_RELAXED)) {
+        if (evict_ != NULL) {
+            evict(evict_);
+        }
+        fd = request(big_);
+        if (fd == -1) {
+            perror("download");
+            sleep(1);
+            continue;
+        }
+        while ((len = recv(fd, buf, sizeof(buf), 0)) > 0
+                && !__atomic_load_n(&quit_, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&received_, len, __ATOMIC_RELAXED);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static
+int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    pthread_t *threads;
+    double *samples, start, elapsed;
+    char buf[4096];
+    int c, i, n, fd, num_big, num_small;
+
+    num_big = 8;
+    num_small = 1000;
+    while ((c = getopt(argc, argv, "h:p:b:s:c:n:e:")) != -1) {
+        switch (c) {
+        case 'h':
+            host_ = optarg;
+            break;
+        case 'p':
+            port_ = optarg;
+            break;
+        case 'b':
+            big_ = optarg;
+            break;
+        case 's':
+            small_ = optarg;
+            break;
+        case 'c':
+            num_big = atoi(optarg);
+            break;
+        case 'n':
+            num_small = atoi(optarg);
+            break;
+        case 'e':
+            evict_ = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h HOST] [-p PORT] [-b BIG_PATH] "
+                    "[-s SMALL_PATH] [-c DOWNLOADS] [-n REQUESTS] "
+                    "[-e BIG_FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (num_big < 0 || num_small <= 0) {
+        return 1;
+    }
+    threads = calloc(num_big + 1, sizeof(pthread_t));
+    samples = calloc(num_small, sizeof(double));
+    if (threads == NULL || samples == NULL) {
+        return 1;
+    }
+    elapsed = now_us();
+    for (i = 0; i < num_big; ++i) {
+        pthread_create(&threads[i], NULL, &download, NULL);
+    }
+    sleep(1);                           /* downloads are running */
+    for (i = 0, n = 0; i < num_small; ++i) {
+        start = now_us();
+        fd = request(small_);
+        if (fd == -1) {
+            continue;
+        }
+        if (recv(fd, buf, sizeof(buf), 0) > 0) {
+            samples[n++] = now_us() - start;
+            while (recv(fd, buf, sizeof(buf), 0) > 0) {
+            }
+        }
+        close(fd);
+    }
+    __atomic_store_n(&quit_, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < num_big; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = now_us() - elapsed;
+    if (n == 0) {
+        fprintf(stderr, "No response from %s:%s\n", host_, port_);
+        return 1;
+    }
+    qsort(samples, n, sizeof(double), &compare);
+    printf("%d downloads of %s%s, %d requests of %s\n", num_big, big_,
+            evict_ != NULL ? " (cold)" : "", n, small_);
+    printf("downloads: %.1f MB/s\n", received_ / elapsed);
+    printf("ttfb (us): p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+            samples[n / 2], samples[n * 9 / 10], samples[n * 99 / 100],
+            samples[n - 1]);
+    free(samples);
+    free(threads);
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */
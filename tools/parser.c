@@ -0,0 +1,209 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+/* Request parser benchmark (make bench-parser) and libFuzzer target
+ * (make fuzz-parser, built with -DFUZZ) for the functions of http.c which
+ * handle client data. Both check the header hash table first, the build
+ * runs "bench-parser check" and fails if a header is misplaced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+#include <aranea/aranea.h>
+
+A_TLS time_t g_curtime;
+struct config_t g_config = {
+    .root = "/var/www",
+    .root_length = sizeof("/var/www") - 1,
+};
+A_TLS char g_buff[GBUFF_LENGTH];
+A_TLS struct server_t g_server;
+
+/** Run one request through the functions, as client_process does
+ * @return 0 if it is a valid request.
+ */
+static
+int parser_run(char *data, int len) {
+    struct request_t request;
+    char path[MAX_PATH_LENGTH];
+
+    memset(&request, 0, sizeof(request));
+    len = http_find_headerlength(data, len, 0);
+    if (len < 0) {
+        return -1;
+    }
+    if (http_parse(&request, data, len) != 0 || request.url == NULL) {
+        return -1;
+    }
+    if (http_get_realpath(&request, path) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/** Check the slots of the request headers table
+ * @return 0 if every header is in its hash slot.
+ */
+static
+int parser_check() {
+    const char *name;
+
+    name = http_check_headers();
+    if (name != NULL) {
+        fprintf(stderr, "header %s is not in its hash slot\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+#if defined(FUZZ)
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    (void)argc;
+    (void)argv;
+    if (parser_check() != 0) {
+        abort();
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    /* one more byte, url functions need a NULL terminated string */
+    char buf[MAX_REQUEST_LENGTH + 1];
+    int len;
+
+    if (size > MAX_REQUEST_LENGTH) {
+        return 0;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    /* resuming the search (data received in two parts) must give the same
+     * result when the termination was not complete in the first part */
+    len = http_find_headerlength(buf, size, 0);
+    if (len > (int)size / 2
+            && http_find_headerlength(buf, size, size / 2) != len) {
+        abort();
+    }
+    parser_run(buf, size);
+    return 0;
+}
+
+#else   /* benchmark */
+
+#define BENCH_ROUNDS            200000
+
+static
+const char * const CORPUS[] = {
+    /* browser */
+    "GET /static/js/app.min.js?v=20121130 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.11 "
+    "(KHTML, like Gecko) Chrome/23.0.1271.97 Safari/537.11\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip,deflate,sdch\r\n"
+    "Accept-Language: en-US,en;q=0.8\r\n"
+    "Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.3\r\n"
+    "If-Modified-Since: Sun, 03 Mar 2013 14:02:51 GMT\r\n"
+    "\r\n",
+    /* curl */
+    "GET /index.html HTTP/1.1\r\n"
+    "User-Agent: curl/7.26.0\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    /* bot */
+    "GET /wp-login.php%3Fredirect_to%3D%2Fadmin%2F HTTP/1.0\r\n"
+    "Host: 10.0.0.1\r\n"
+    "User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; "
+    "+http://www.google.com/bot.html)\r\n"
+    "From: googlebot(at)googlebot.com\r\n"
+    "Accept-Encoding: gzip,deflate\r\n"
+    "\r\n",
+    /* large cookie */
+    "GET /account/settings/../profile/./avatar.png HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 6.1; WOW64; rv:17.0) "
+    "Gecko/20100101 Firefox/17.0\r\n"
+    "Accept: image/png,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Connection: keep-alive\r\n"
+    "Range: bytes=0-1023\r\n"
+    "Cookie: __utma=111872281.1637264588.1354026236.1354026236.1354026236.1;"
+    " __utmz=111872281.1354026236.1.1.utmcsr=(direct)|utmccn=(direct)|"
+    "utmcmd=(none); session=5f4dcc3b5aa765d61d8327deb882cf99"
+    "5f4dcc3b5aa765d61d8327deb882cf995f4dcc3b5aa765d61d8327deb882cf99;"
+    " prefs=lang%3Den%26tz%3DEurope%2FParis%26theme%3Ddark%26layout%3D"
+    "wide%26sidebar%3Dcollapsed%26notifications%3Doff%26beta%3Don;"
+    " tracking=a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4"
+    "e5f6a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4e5f6a1b2c3d4e5f6\r\n"
+    "\r\n",
+};
+
+static
+uint64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char **argv) {
+    char buf[MAX_REQUEST_LENGTH + 1];
+    struct timespec start, end;
+    uint64_t cycles;
+    double ns;
+    int i, n, len;
+
+    if (parser_check() != 0) {
+        return 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "check") == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < (int)A_SIZEOF(CORPUS); ++i) {
+        len = strlen(CORPUS[i]);
+        if (len > MAX_REQUEST_LENGTH) {
+            fprintf(stderr, "request %d is too large: %d\n", i, len);
+            return 1;
+        }
+        memcpy(buf, CORPUS[i], len + 1);
+        if (parser_run(buf, len) != 0) {
+            fprintf(stderr, "request %d is invalid\n", i);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cycles = bench_cycles();
+        for (n = 0; n < BENCH_ROUNDS; ++n) {
+            /* parsing modifies the data */
+            memcpy(buf, CORPUS[i], len + 1);
+            parser_run(buf, len);
+        }
+        cycles = bench_cycles() - cycles;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+        fprintf(stdout, "request %d: %4d bytes %8.1f ns/request", i, len,
+                ns / BENCH_ROUNDS);
+        if (cycles > 0) {
+            fprintf(stdout, " %6.2f bytes/cycle",
+                    (double)len * BENCH_ROUNDS / cycles);
+        }
+        fprintf(stdout, "\n");
+    }
+    return 0;
+}
+
+#endif  /* FUZZ */
+
+/* vim: set ts=4 sw=4 expandtab: */
@@ -0,0 +1,198 @@
+/* Aranea
+ * Copyright (c) 2011-2012, Quoc-Viet Nguyen
+ * See LICENSE file for copyright and license details.
+ */
+
+/* Check the answers to Range requests of a running server (make
+ * check-ranges): overlapping and adjacent ranges are merged, and several
+ * covering the whole file get a 200. The file must have at least 30 bytes,
+ * the one given with -e none.
+ *
+ * Usage: ./check-ranges [-h HOST] [-p PORT] [-f PATH] [-e PATH]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+struct case_t {
+    const char *range;
+    int status;
+    long from;          /**< First range sent, -1 for 200 */
+    long to;            /**< -1 for the end of the file */
+    int parts;          /**< Of multipart/byteranges, 0 if single */
+    int empty;          /**< Asked for the empty file */
+};
+
+static const struct case_t cases_[] = {
+    { "0-,0-",              200, -1, -1, 0, 0 }, /* repeated */
+    { "-10,0-",             200, -1, -1, 0, 0 }, /* whole file */
+    { "0-9,5-19",           206, 0, 19, 0, 0 },  /* overlapping */
+    { "0-9,10-19",          206, 0, 19, 0, 0 },  /* adjacent */
+    { "20-29,0-9,5-7",      206, 0, 9, 2, 0 },   /* sorted */
+    { "0-",                 206, 0, -1, 0, 0 },  /* a single one is kept */
+    { "-5",                 416, -1, -1, 0, 1 }, /* empty file */
+    { "0-,-5",              416, -1, -1, 0, 1 },
+};
+
+static const char *host_ = "127.0.0.1";
+static const char *port_ = "8080";
+static const char *path_ = "/big.bin";
+static const char *empty_ = "/empty.txt";
+
+/** Send a request and read the answer until the server closes.
+ * @return total length, the first sz - 1 bytes are in buf.
+ */
+static
+long fetch(const char *method, const char *path, const char *range,
+        char *buf, size_t sz) {
+    struct addrinfo hints, *res;
+    char req[512];
+    long total;
+    ssize_t n;
+    int fd, len;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host_, port_, &hints, &res) != 0) {
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        return -1;
+    }
+    len = snprintf(req, sizeof(req), "%s %s HTTP/1.0\r\nRange: bytes=%s"
+            "\r\n\r\n", method, path, range);
+    if (send(fd, req, len, 0) != len) {
+        close(fd);
+        return -1;
+    }
+    total = 0;
+    for (;;) {
+        if ((size_t)total < sz - 1) {
+            n = recv(fd, buf + total, sz - 1 - total, 0);
+        } else {
+            n = recv(fd, req, sizeof(req), 0);
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    buf[((size_t)total < sz - 1) ? (size_t)total : sz - 1] = '\0';
+    return total;
+}
+
+static
+long header_value(const char *buf, const char *name) {
+    const char *p;
+
+    p = strstr(buf, name);
+    return (p == NULL) ? -1 : atol(p + strlen(name));
+}
+
+/** @return 0 if the answer is the expected one.
+ */
+static
+int check(const struct case_t *t, long size) {
+    char buf[65536], expected[64];
+    const char *body, *p;
+    long total, length, to;
+    int parts;
+
+    total = fetch("GET", t->empty ? empty_ : path_, t->range, buf,
+            sizeof(buf));
+    body = strstr(buf, "\r\n\r\n");
+    if (total < 0 || body == NULL) {
+        return -1;
+    }
+    body += 4;
+    if (t->status == 416) {
+        /* an error page, without any part of the file */
+        return (atoi(buf + 9) == 416
+                && strstr(buf, "Content-Range: bytes ") == NULL) ? 0 : -1;
+    }
+    length = header_value(buf, "Content-Length: ");
+    if (atoi(buf + 9) != t->status || length != total - (body - buf)) {
+        return -1;
+    }
+    if (t->status == 200) {
+        return (length == size && strstr(buf, "Content-Range") == NULL)
+                ? 0 : -1;
+    }
+    to = (t->to < 0) ? size - 1 : t->to;
+    snprintf(expected, sizeof(expected), "Content-Range: bytes %ld-%ld/%ld",
+            t->from, to, size);
+    if (t->parts == 0) {
+        return (strstr(buf, expected) != NULL
+                && length == to - t->from + 1) ? 0 : -1;
+    }
+    /* the first part is the lowest range */
+    p = strstr(body, "Content-Range: ");
+    if (p == NULL || strncmp(p, expected, strlen(expected)) != 0) {
+        return -1;
+    }
+    for (parts = 0; p != NULL; p = strstr(p + 1, "Content-Range: ")) {
+        ++parts;
+    }
+    return (parts == t->parts) ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    char buf[4096];
+    long size;
+    unsigned int i;
+    int c, failed;
+
+    while ((c = getopt(argc, argv, "h:p:f:e:")) != -1) {
+        switch (c) {
+        case 'h':
+            host_ = optarg;
+            break;
+        case 'p':
+            port_ = optarg;
+            break;
+        case 'f':
+            path_ = optarg;
+            break;
+        case 'e':
+            empty_ = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h HOST] [-p PORT] [-f PATH] "
+                    "[-e PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (fetch("HEAD", path_, "0-", buf, sizeof(buf)) < 0) {
+        fprintf(stderr, "Could not connect to %s:%s\n", host_, port_);
+        return 1;
+    }
+    /* the answer to "0-" gives the size */
+    size = header_value(buf, "Content-Length: ");
+    if (size < 30) {
+        fprintf(stderr, "%s is too small\n", path_);
+        return 1;
+    }
+    failed = 0;
+    for (i = 0; i < sizeof(cases_) / sizeof(cases_[0]); ++i) {
+        if (check(&cases_[i], cases_[i].empty ? 0 : size) != 0) {
+            printf("FAIL bytes=%s\n", cases_[i].range);
+            ++failed;
+        } else {
+            printf("ok   bytes=%s\n", cases_[i].range);
+        }
+    }
+    return (failed > 0) ? 1 : 0;
+}
+
+/* vim: set ts=4 sw=4 expandtab: */